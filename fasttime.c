@@ -6,34 +6,46 @@
  */
 #include <assert.h>
 #include <dlfcn.h>
-#ifdef __sun
+#include <inttypes.h>
 #include <fcntl.h>
-#endif
 /* remove limits when done debugging */
 #include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#ifdef __linux
 #include <string.h>
+#ifdef __linux
+#include <cpuid.h>
+#endif
+#ifdef __linux
+#include <sys/mman.h>
 #endif
 #ifdef __sun
 #include <sys/processor.h>
 #include <sys/stat.h>
 #endif
+#ifdef __linux
+#include <sys/syscall.h>
+#endif
 #include <sys/types.h>
 #include <sys/time.h>
 #include <time.h>
-#ifdef __sun
 #include <unistd.h>
-#endif
+
+#include "fasttime.h"
+
+struct node_state;
 
 static void __attribute__ ((constructor)) _init_fasttime();
 static void sync_local_clock();
+static uint64_t sync_monotonic(uint64_t now, struct node_state *nd);
+static void validate_local_clock(uint64_t prev_sys, uint64_t prev_tsc,
+    uint64_t prev_scale);
 
 static unsigned int		approx_cpu_hz; /* approximate CPU Hz */
 static uint64_t			nsec_scale;    /* NANOSEC / CPU Hz */
+static uint64_t			tsc_scale;     /* nsec_scale at load */
 
 /*
  * Local cache of the system TOD clock and the TSC cycle count. These
@@ -43,7 +55,98 @@ static uint64_t			nsec_scale;    /* NANOSEC / CPU Hz */
 static __thread struct timespec	base_ts = {0,0}; /* sys clock value */
 static __thread uint64_t	base_sys = 0UL;	 /* base_ts in nanos */
 static __thread uint64_t	base_tsc = 0UL;	 /* TSC value (cycles) */
+static __thread uint64_t	base_scale = 0UL; /* nsec_scale at sync */
+static __thread uint64_t	base_sync_nsec = 0UL; /* resync after */
+
+/*
+ * Anchor of the monotonic clock to the kernel's CLOCK_MONOTONIC,
+ * shared by all threads. Readers extrapolate from ms_tsc/ms_ns at
+ * rate ms_scale until ms_next_tsc; the first one past that samples
+ * the kernel and republishes the anchor with the offset and rate
+ * corrected so the two clocks converge without the local one going
+ * backwards. Readers and the writer synchronize on ms_seq (seqlock,
+ * odd while a write is in progress).
+ */
+typedef struct mono_snap {
+	uint32_t	ms_seq;		/* seqlock sequence */
+	uint64_t	ms_tsc;		/* TSC at anchor (cycles) */
+	uint64_t	ms_ns;		/* monotonic nanos at anchor */
+	uint64_t	ms_scale;	/* rate, same units as nsec_scale */
+	uint64_t	ms_next_tsc;	/* TSC at which to resync */
+} mono_snap_t;
+
+/*
+ * The state the clocks read, replicated per NUMA node so a read never
+ * has to fetch a line from a remote socket: the monotonic anchor,
+ * written at every resync, and the calibration. Each replica is on a
+ * page bound to its node (see init_nodes()). Writers update every
+ * replica; readers use the one for the node they're running on, from
+ * RDTSCP's TSC_AUX which Linux loads with node << 12 | cpu (the same
+ * value getcpu() reports). With a single node there is one replica
+ * and readers use plain RDTSC.
+ */
+#define	NODES_MAX	64
+
+typedef struct node_state {
+	mono_snap_t	nd_mono;	/* monotonic anchor */
+	uint64_t	nd_nsec_scale;	/* nsec_scale */
+	uint64_t	nd_sync_nsec;	/* local clock resync period */
+} node_state_t;
+
+static node_state_t		node0 __attribute__((aligned(64)));
+static node_state_t		*nodes[NODES_MAX] = { &node0 };
+static unsigned int		num_nodes = 1;
+
+static int			mono_lock;	/* held by the resyncing thread */
+static uint64_t			mono_kern_tsc;	/* TSC at last kernel sample */
+static uint64_t			mono_kern_ns;	/* kernel nanos at last sample */
+static uint64_t			mono_sync_tsc;	/* MONO_SYNC_NSEC in cycles */
+static uint64_t			mono_period_tsc; /* current resync period */
+static uint64_t			mono_rate;	/* kernel's rate, unslewed */
+
+/*
+ * Last value handed out by ft_unique_ns(), and by ft_unique_ns_shard()
+ * per shard. Each is on a cache line of its own: the global counter
+ * so its CAS traffic stays off the lines the clocks read, the shards
+ * so that threads on different shards never write a shared line.
+ */
+typedef struct unique_last {
+	uint64_t	ul_ns;
+	char		ul_pad[64 - sizeof (uint64_t)];
+} unique_last_t;
+
+static unique_last_t		unique __attribute__((aligned(64)));
+static unique_last_t		unique_shard[FT_UNIQUE_SHARD_MAX + 1]
+    __attribute__((aligned(64)));
+
+/*
+ * Shadow validation (opt-in, see init_validate()). When a thread
+ * resyncs its local clock it has, for free, both the value the fast
+ * path would have returned and the kernel's; at most once per
+ * validate_period_tsc one of them records the difference. Too many
+ * consecutive checks over validate_max_ns recalibrate nsec_scale
+ * against the kernel's CLOCK_MONOTONIC, then fall back to passthrough.
+ */
+enum validate_action {
+	VALIDATE_LOG = 0,	/* record only */
+	VALIDATE_RECALIBRATE,	/* recalibrate, then passthrough */
+	VALIDATE_PASSTHROUGH	/* passthrough */
+};
+
+typedef struct validate_state {
+	uint64_t		vd_next_tsc;	/* TSC at which a check is due */
+	uint64_t		vd_ref_tsc;	/* TSC at last kernel sample */
+	uint64_t		vd_ref_ns;	/* kernel monotonic nanos then */
+	unsigned int		vd_over;	/* consecutive checks over max */
+	unsigned int		vd_recal;	/* recalibrations since ok */
+	ft_validate_stats_t	vd_stats;
+} validate_state_t;
 
+static validate_state_t		vd __attribute__((aligned(64)));
+static uint64_t			validate_period_tsc; /* 0 if disabled */
+static uint64_t			validate_max_ns;
+static enum validate_action	validate_action;
+static int			mono_pass;	/* monotonic is passthrough */
 
 /*
  * Pointers to system functions.
@@ -61,11 +164,31 @@ int (*_sys_gettimeofday)(struct timeval *tp, struct timezone *tz);
 #define NANOSEC		1000000000L
 #endif
 #define	MHZ_TO_HZ(mhz)	(mhz * 1000000)
+#define	FT_INLINE	static inline __attribute__((always_inline))
 #define	NSEC_SHIFT 5
+#define	MONO_SYNC_NSEC	(10 * (NANOSEC / MILLISEC)) /* resync period */
+#define	MONO_RATE_MAX_NSEC (60 * (uint64_t)NANOSEC) /* rate sample limit */
+#define	MONO_MAX_SLEW_PPM 500
+#define	LOCAL_SYNC_NSEC	(1 * (NANOSEC / MILLISEC)) /* local clock resync */
+#define	VALIDATE_MAX_NSEC 10000	/* default error threshold */
+#define	VALIDATE_OVER	3	/* consecutive checks over max to act */
+#ifndef MPOL_PREFERRED
+#define	MPOL_PREFERRED	1
+#endif
+#ifdef __SIZEOF_INT128__
+/*
+ * Same result as the split multiply below but done as a single
+ * widening multiply.
+ */
+#define	TSC_CONVERT(tsc, scale)						\
+	(tsc.tsc_64 = (uint64_t)					\
+	    (((unsigned __int128)tsc.tsc_64 * (scale)) >> (32 - NSEC_SHIFT)))
+#else
 #define	TSC_CONVERT(tsc, scale)						\
 	(tsc.tsc_64 =							\
-	    (((uint64_t)tsc.tsc_32[1] * nsec_scale) << NSEC_SHIFT) +	\
-	    (((uint64_t)tsc.tsc_32[0] * nsec_scale) >> (32 - NSEC_SHIFT)))
+	    (((uint64_t)tsc.tsc_32[1] * (scale)) << NSEC_SHIFT) +	\
+	    (((uint64_t)tsc.tsc_32[0] * (scale)) >> (32 - NSEC_SHIFT)))
+#endif
 
 typedef union tscu {
 	uint64_t tsc_64;
@@ -200,6 +323,162 @@ get_cpu_mhz()
 
 #endif
 
+#ifdef __linux
+
+/*
+ * A system call with up to three arguments, without going through
+ * libc. For count_nodes(), which the ifunc resolvers call: they can
+ * run while the dynamic linker is still relocating, before calls into
+ * libc (or even this object's own PLT) are safe.
+ */
+static long
+raw_syscall(long nr, long a1, long a2, long a3)
+{
+	long ret;
+
+#ifdef __x86_64__
+	__asm__ volatile("syscall" : "=a" (ret)
+	    : "0" (nr), "D" (a1), "S" (a2), "d" (a3)
+	    : "rcx", "r11", "memory");
+#else
+	__asm__ volatile("int $0x80" : "=a" (ret)
+	    : "0" (nr), "b" (a1), "c" (a2), "d" (a3)
+	    : "memory");
+#endif
+
+	return (ret);
+}
+
+/*
+ * The number of NUMA node replicas of the node state, 1 if there is
+ * only one node, if RDTSCP isn't there to tell readers which node
+ * they're on, or if the node list can't be read. Computed on first
+ * use, which is the first ifunc resolver to run.
+ */
+static unsigned int
+count_nodes()
+{
+	static unsigned int count;
+	unsigned int eax, ebx, ecx, edx, n = 0, id;
+	char line[256];
+	long fd, len, i;
+
+	if (count != 0)
+		return (count);
+	count = 1;
+
+	/*
+	 * CPUID.80000001H:EDX[27] -- presence of RDTSCP
+	 */
+	if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) == 0 ||
+	    (edx & 0x8000000) == 0)
+		return (count);
+
+	fd = raw_syscall(SYS_open, (long)"/sys/devices/system/node/online",
+	    O_RDONLY, 0);
+	if (fd < 0)
+		return (count);
+	len = raw_syscall(SYS_read, fd, (long)line, sizeof (line));
+	(void) raw_syscall(SYS_close, fd, 0, 0);
+
+	/* A list of ranges, e.g. "0-1" or "0,2-3"; we need the highest. */
+	for (i = 0; i < len; ) {
+		if (line[i] < '0' || line[i] > '9') {
+			i++;
+			continue;
+		}
+		for (id = 0; i < len && line[i] >= '0' && line[i] <= '9'; i++) {
+			if (id < NODES_MAX)
+				id = id * 10 + (line[i] - '0');
+		}
+		if (id + 1 > n)
+			n = id + 1;
+	}
+
+	if (n > 1)
+		count = (n > NODES_MAX) ? NODES_MAX : n;
+
+	return (count);
+}
+
+/*
+ * Give each NUMA node its own replica of the node state, on a page
+ * bound to the node before it is first touched. Stays with the single
+ * static replica if count_nodes() says one, or if anything fails.
+ */
+static void
+init_nodes()
+{
+	unsigned int n = count_nodes(), i, bits = 8 * sizeof (unsigned long);
+	unsigned long mask[NODES_MAX / (8 * sizeof (unsigned long))];
+	node_state_t *replica[NODES_MAX];
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (n <= 1)
+		return;
+
+	for (i = 0; i < n; i++) {
+		replica[i] = mmap(NULL, pagesize, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (replica[i] == MAP_FAILED) {
+			while (i-- > 0)
+				(void) munmap(replica[i], pagesize);
+			return;
+		}
+
+		/* Best effort, e.g. not permitted in some containers. */
+		(void) memset(mask, 0, sizeof (mask));
+		mask[i / bits] = 1UL << (i % bits);
+		(void) syscall(SYS_mbind, replica[i], pagesize, MPOL_PREFERRED,
+		    mask, sizeof (mask) * 8 + 1, 0);
+		(void) memset(replica[i], 0, sizeof (node_state_t));
+	}
+
+	for (i = 0; i < n; i++)
+		nodes[i] = replica[i];
+	num_nodes = n;
+}
+
+#endif
+
+/*
+ * Read the shadow validation settings from the environment:
+ *
+ * FASTTIME_VALIDATE		check every this many milliseconds, unset
+ *				or 0 disables validation
+ * FASTTIME_VALIDATE_MAX_NS	error threshold in nanoseconds
+ * FASTTIME_VALIDATE_ACTION	log, recalibrate (default) or passthrough
+ */
+static void
+init_validate()
+{
+	char *s;
+	uint64_t ms;
+
+	if ((s = getenv("FASTTIME_VALIDATE")) == NULL ||
+	    (ms = strtoull(s, NULL, 10)) == 0)
+		return;
+
+	validate_max_ns = VALIDATE_MAX_NSEC;
+	if ((s = getenv("FASTTIME_VALIDATE_MAX_NS")) != NULL)
+		validate_max_ns = strtoull(s, NULL, 10);
+
+	validate_action = VALIDATE_RECALIBRATE;
+	if ((s = getenv("FASTTIME_VALIDATE_ACTION")) != NULL) {
+		if (strcmp(s, "log") == 0) {
+			validate_action = VALIDATE_LOG;
+		} else if (strcmp(s, "passthrough") == 0) {
+			validate_action = VALIDATE_PASSTHROUGH;
+		} else if (strcmp(s, "recalibrate") != 0) {
+			fprintf(stderr, "unknown FASTTIME_VALIDATE_ACTION %s\n",
+			    s);
+			exit(1);
+		}
+	}
+
+	validate_period_tsc = (uint64_t)approx_cpu_hz / MILLISEC * ms;
+}
+
 /*
  * The retrieval of the clock time and the TSC are not atomic, there
  * may be time unaccounted for.
@@ -215,6 +494,21 @@ get_cpu_mhz()
 static void
 _init_fasttime()
 {
+	static int state;	/* 0 not started, 1 running, 2 done */
+	unsigned int i;
+
+	/*
+	 * Runs as a constructor, or before that from the first read if
+	 * another library's constructor reads the clock first (see the
+	 * _sys_clock_gettime checks). Either way only once; it sets
+	 * _sys_clock_gettime before any read of its own.
+	 */
+	if (!__sync_bool_compare_and_swap(&state, 0, 1)) {
+		while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != 2)
+			;
+		return;
+	}
+
 	(void) check_tsc();
 
 	if ((_sys_clock_gettime = dlsym(RTLD_NEXT, "clock_gettime")) == NULL) {
@@ -238,8 +532,50 @@ _init_fasttime()
 	approx_cpu_hz = MHZ_TO_HZ(get_cpu_mhz());
 	nsec_scale =
 	    (uint64_t)(((uint64_t)NANOSEC << (32 - NSEC_SHIFT)) / approx_cpu_hz);
+	mono_sync_tsc = approx_cpu_hz / (NANOSEC / MONO_SYNC_NSEC);
+
+	/*
+	 * Absolute TSC values (gethrtime(), ft_tsc_to_ns()) are always
+	 * converted with the load time scale; were they to pick up a
+	 * recalibrated one the result would jump.
+	 */
+	tsc_scale = nsec_scale;
 
+#ifdef __linux
+	init_nodes();
+#endif
+	for (i = 0; i < num_nodes; i++) {
+		nodes[i]->nd_nsec_scale = nsec_scale;
+		nodes[i]->nd_sync_nsec = LOCAL_SYNC_NSEC;
+	}
+
+	init_validate();
 	sync_local_clock();
+	(void) sync_monotonic(0, nodes[0]);
+
+	__atomic_store_n(&state, 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Read the TSC, output the replica of the node state for the node
+ * this CPU is on via nd. numa is a constant on the fast path, set in
+ * the ifunc targets bound when count_nodes() found more than one node.
+ */
+FT_INLINE uint64_t
+rdtsc_node(node_state_t **nd, int numa)
+{
+	unsigned int a, d, aux;
+
+	if (!numa) {
+		__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
+		*nd = &node0;
+	} else {
+		__asm__ volatile("rdtscp" : "=a" (a), "=d" (d), "=c" (aux));
+		aux >>= 12;
+		*nd = nodes[(aux < num_nodes) ? aux : 0];
+	}
+
+	return (((uint64_t)a) | ((uint64_t)d) << 32);
 }
 
 /*
@@ -248,7 +584,11 @@ _init_fasttime()
 static void
 sync_local_clock()
 {
-	unsigned int a, d;
+	node_state_t *nd;
+
+	/* Called before our constructor, by another library's. */
+	if (_sys_clock_gettime == NULL)
+		_init_fasttime();
 
 	if (_sys_clock_gettime(CLOCK_REALTIME, &base_ts) == -1) {
 		perror("failed to init fasttime base");
@@ -262,60 +602,456 @@ sync_local_clock()
 	 * behind the real kernel clock because of missing nanos.
 	 *
 	 */
-	__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
-	base_tsc = ((uint64_t)a) | ((uint64_t)d) << 32;
+	base_tsc = rdtsc_node(&nd, num_nodes > 1);
+	base_scale = __atomic_load_n(&nd->nd_nsec_scale, __ATOMIC_RELAXED);
+	base_sync_nsec = __atomic_load_n(&nd->nd_sync_nsec, __ATOMIC_RELAXED);
 }
 
+/*
+ * Take a consistent copy of a replica of the monotonic anchor.
+ */
+FT_INLINE void
+mono_read(const mono_snap_t *ms, mono_snap_t *snap)
+{
+	uint32_t seq;
 
-int
-#ifdef __sun
-gettimeofday(struct timeval *tp, void __attribute__((unused)) *tzp)
-#elif __linux
-gettimeofday(struct timeval *tp, struct timezone __attribute__((unused)) *tz)
-#endif
+	do {
+		seq = __atomic_load_n(&ms->ms_seq, __ATOMIC_ACQUIRE);
+		snap->ms_tsc = __atomic_load_n(&ms->ms_tsc, __ATOMIC_RELAXED);
+		snap->ms_ns = __atomic_load_n(&ms->ms_ns, __ATOMIC_RELAXED);
+		snap->ms_scale =
+		    __atomic_load_n(&ms->ms_scale, __ATOMIC_RELAXED);
+		snap->ms_next_tsc =
+		    __atomic_load_n(&ms->ms_next_tsc, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) != 0 ||
+	    seq != __atomic_load_n(&ms->ms_seq, __ATOMIC_RELAXED));
+}
+
+/*
+ * Publish a new monotonic anchor to every replica. The caller holds
+ * mono_lock.
+ */
+static void
+mono_publish(const mono_snap_t *snap)
+{
+	mono_snap_t *ms;
+	unsigned int i;
+
+	for (i = 0; i < num_nodes; i++) {
+		ms = &nodes[i]->nd_mono;
+
+		__atomic_store_n(&ms->ms_seq, ms->ms_seq + 1,
+		    __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		__atomic_store_n(&ms->ms_tsc, snap->ms_tsc, __ATOMIC_RELAXED);
+		__atomic_store_n(&ms->ms_ns, snap->ms_ns, __ATOMIC_RELAXED);
+		__atomic_store_n(&ms->ms_scale, snap->ms_scale,
+		    __ATOMIC_RELAXED);
+		__atomic_store_n(&ms->ms_next_tsc, snap->ms_next_tsc,
+		    __ATOMIC_RELAXED);
+		__atomic_store_n(&ms->ms_seq, ms->ms_seq + 1,
+		    __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Monotonic nanos at TSC value now according to snap.
+ */
+FT_INLINE uint64_t
+mono_extrapolate(const mono_snap_t *snap, uint64_t now)
 {
-	unsigned int a, d;
 	tscu_t tsc;
 
-	if (tp == NULL)
-		return (0);
+	/*
+	 * Another CPU may have taken the anchor a hair after our TSC
+	 * reading, don't let that wrap.
+	 */
+	if (now < snap->ms_tsc)
+		return (snap->ms_ns);
+
+	tsc.tsc_64 = now - snap->ms_tsc;
+	TSC_CONVERT(tsc, snap->ms_scale);
+
+	return (snap->ms_ns + tsc.tsc_64);
+}
+
+/*
+ * Sample the kernel's CLOCK_MONOTONIC along with the TSC value at
+ * that instant, output via ns and tsc. The TSC is read on both sides
+ * of the kernel call and the midpoint used; if the two are too far
+ * apart (preempted, interrupted, slow clocksource) the sample is
+ * retried a few times. Returns -1 if none was close enough, the
+ * output is then the closest one.
+ */
+static int
+sample_monotonic(uint64_t *tsc, uint64_t *ns)
+{
+	struct timespec ts;
+	unsigned int a, d;
+	uint64_t before, after, best = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
+		before = ((uint64_t)a) | ((uint64_t)d) << 32;
+
+		if (_sys_clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+			perror("failed to sync fasttime monotonic clock");
+			exit(1);
+		}
+
+		__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
+		after = ((uint64_t)a) | ((uint64_t)d) << 32;
+
+		if (after - before < best) {
+			best = after - before;
+			*tsc = before + best / 2;
+			*ns = ((uint64_t)ts.tv_sec * NANOSEC) + ts.tv_nsec;
+		}
+
+		if (best < mono_sync_tsc / 10000)
+			return (0);
+	}
+
+	return (-1);
+}
+
+/*
+ * Resync the shared monotonic anchor with the kernel. now is the
+ * caller's TSC reading and nd the node it was taken on, its monotonic
+ * value is returned.
+ *
+ * Readers only extrapolate up to ms_next_tsc, so the anchor's value
+ * there is the highest anyone has been handed. If the kernel is past
+ * it the clock steps forward to the kernel; otherwise it holds there
+ * and slews back by at most MONO_MAX_SLEW_PPM over the next period.
+ * The rate is the kernel's, measured since the last resync; a sample
+ * too loosely paired with the TSC still moves the anchor but not the
+ * rate, so a slow kernel clock never stops this one.
+ *
+ * If another thread is already resyncing the value at ms_next_tsc of
+ * the local replica is returned: the new anchor can't be below it,
+ * while the kernel's value could be. Only the one resyncing touches
+ * the other nodes' replicas; the rest test mono_lock before trying to
+ * take it, so they don't bounce its cache line around either. Once
+ * the clock has been switched to passthrough the kernel's value is
+ * returned directly, bounded the same way.
+ */
+static uint64_t
+sync_monotonic(uint64_t now, node_state_t *nd)
+{
+	uint64_t kern_ns, hi_ns, ns, max_adj;
+	int64_t adj;
+	int bad;
+	mono_snap_t snap;
+	struct timespec ts;
+
+	/* Read before the constructor ran, from another one. */
+	if (_sys_clock_gettime == NULL)
+		_init_fasttime();
+
+	mono_read(&nd->nd_mono, &snap);
+	hi_ns = (snap.ms_scale == 0) ? 0 :
+	    mono_extrapolate(&snap, snap.ms_next_tsc);
+
+	if (__atomic_load_n(&mono_pass, __ATOMIC_RELAXED)) {
+		(void) _sys_clock_gettime(CLOCK_MONOTONIC, &ts);
+		kern_ns = ((uint64_t)ts.tv_sec * NANOSEC) + ts.tv_nsec;
+		return (kern_ns > hi_ns ? kern_ns : hi_ns);
+	}
+
+	if (__atomic_load_n(&mono_lock, __ATOMIC_RELAXED) != 0 ||
+	    !__sync_bool_compare_and_swap(&mono_lock, 0, 1)) {
+		if (hi_ns != 0)
+			return (hi_ns);
+
+		/* No anchor yet to bound by, wait for the first. */
+		while (__atomic_load_n(&mono_lock, __ATOMIC_ACQUIRE) != 0)
+			;
+		mono_read(&nd->nd_mono, &snap);
+		return (mono_extrapolate(&snap, now));
+	}
+
+	/*
+	 * Every replica is the same while the lock is held. If another
+	 * thread resynced, or switched to passthrough, since the read
+	 * above, there's nothing to do here.
+	 */
+	mono_read(&nd->nd_mono, &snap);
+	if (__atomic_load_n(&mono_pass, __ATOMIC_RELAXED)) {
+		__sync_lock_release(&mono_lock);
+		return (sync_monotonic(now, nd));
+	}
+	if (now < snap.ms_next_tsc) {
+		__sync_lock_release(&mono_lock);
+		return (mono_extrapolate(&snap, now));
+	}
+	hi_ns = (snap.ms_scale == 0) ? 0 :
+	    mono_extrapolate(&snap, snap.ms_next_tsc);
+
+	bad = (sample_monotonic(&now, &kern_ns) != 0);
+
+	/*
+	 * Until the kernel's rate has been measured the clock runs on
+	 * the calibrated nsec_scale, which may be well off. Start with
+	 * a short period and double it up to mono_sync_tsc so that
+	 * error doesn't get a chance to build up.
+	 */
+	if (snap.ms_scale == 0) {
+		mono_rate = nsec_scale;
+		mono_period_tsc = mono_sync_tsc >> 7;
+		mono_kern_tsc = now;
+		mono_kern_ns = kern_ns;
+	} else {
+		if (mono_period_tsc < mono_sync_tsc)
+			mono_period_tsc <<= 1;
+
+		if (!bad && kern_ns - mono_kern_ns <= MONO_RATE_MAX_NSEC) {
+			mono_rate = ((kern_ns - mono_kern_ns) <<
+			    (32 - NSEC_SHIFT)) / (now - mono_kern_tsc);
+		}
+		if (!bad) {
+			mono_kern_tsc = now;
+			mono_kern_ns = kern_ns;
+		}
+	}
+
+	if (kern_ns >= hi_ns) {
+		ns = kern_ns;
+		adj = 0;
+	} else {
+		ns = hi_ns;
+		max_adj = mono_rate * MONO_MAX_SLEW_PPM / 1000000;
+		adj = -(int64_t)(((hi_ns - kern_ns) << (32 - NSEC_SHIFT)) /
+		    mono_period_tsc);
+		if (adj < -(int64_t)max_adj)
+			adj = -(int64_t)max_adj;
+	}
+
+	snap.ms_tsc = now;
+	snap.ms_ns = ns;
+	snap.ms_scale = mono_rate + adj;
+	snap.ms_next_tsc = now + mono_period_tsc;
+	mono_publish(&snap);
+
+	__sync_lock_release(&mono_lock);
+
+	return (ns);
+}
+
+/*
+ * Stop using the TSC: every realtime read resyncs the local clock
+ * (i.e. returns the kernel's value) and every monotonic read goes to
+ * the kernel. The monotonic anchor is republished to hold at the
+ * highest value already handed out so it stays monotonic.
+ */
+static void
+set_passthrough()
+{
+	mono_snap_t snap;
+	unsigned int i;
+
+	for (i = 0; i < num_nodes; i++)
+		__atomic_store_n(&nodes[i]->nd_sync_nsec, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&validate_period_tsc, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&vd.vd_stats.vs_passthrough, 1, __ATOMIC_RELAXED);
+
+	while (!__sync_bool_compare_and_swap(&mono_lock, 0, 1))
+		;
+
+	mono_read(&nodes[0]->nd_mono, &snap);
+	snap.ms_ns = mono_extrapolate(&snap, snap.ms_next_tsc);
+	snap.ms_tsc = UINT64_MAX;
+	snap.ms_next_tsc = 0;
+	__atomic_store_n(&mono_pass, 1, __ATOMIC_RELAXED);
+	mono_publish(&snap);
+
+	__sync_lock_release(&mono_lock);
+
+	fprintf(stderr, "fasttime: clock error over %" PRIu64
+	    "ns, switched to passthrough\n", validate_max_ns);
+}
+
+/*
+ * Replace nsec_scale with the kernel's rate, measured against
+ * CLOCK_MONOTONIC since the previous check. Threads pick it up at
+ * their next local clock resync. tsc_scale and approx_cpu_hz, what
+ * ft_tsc_to_ns() and ft_tsc_hz() report, keep their load time values.
+ *
+ * Returns -1, changing nothing, if there is no usable previous check:
+ * none yet, or more than MONO_RATE_MAX_NSEC ago (the shift below would
+ * overflow). The caller refreshes the reference either way, and falls
+ * back to passthrough.
+ */
+static int
+recalibrate(uint64_t kern_ns, uint64_t tsc)
+{
+	uint64_t scale;
+	unsigned int i, hz;
+
+	if (vd.vd_ref_tsc == 0 || tsc <= vd.vd_ref_tsc ||
+	    kern_ns - vd.vd_ref_ns > MONO_RATE_MAX_NSEC)
+		return (-1);
+
+	scale = ((kern_ns - vd.vd_ref_ns) << (32 - NSEC_SHIFT)) /
+	    (tsc - vd.vd_ref_tsc);
+	__atomic_store_n(&nsec_scale, scale, __ATOMIC_RELAXED);
+	for (i = 0; i < num_nodes; i++)
+		__atomic_store_n(&nodes[i]->nd_nsec_scale, scale,
+		    __ATOMIC_RELAXED);
+	__atomic_fetch_add(&vd.vd_stats.vs_recalibrations, 1,
+	    __ATOMIC_RELAXED);
+
+	hz = (unsigned int)(((uint64_t)NANOSEC << (32 - NSEC_SHIFT)) / scale);
+	fprintf(stderr, "fasttime: clock error over %" PRIu64
+	    "ns, recalibrated to %u Hz\n", validate_max_ns, hz);
+
+	return (0);
+}
+
+/*
+ * Called after the thread's local clock was resynced from
+ * prev_sys/prev_tsc/prev_scale. If a check is due, compare what the old base
+ * would have given at the new base's TSC value with the kernel's
+ * value there and record the error.
+ *
+ * Only resyncs of a busy thread (a little over LOCAL_SYNC_NSEC since
+ * the last) are used, those are the values the fast path actually
+ * hands out; a thread that sat idle would measure calibration error
+ * accumulated over however long it slept.
+ */
+static void
+validate_local_clock(uint64_t prev_sys, uint64_t prev_tsc,
+    uint64_t prev_scale)
+{
+	uint64_t next, abs_err, max, kern_ns, tsc;
+	tscu_t delta;
+	int64_t err;
+
+	next = __atomic_load_n(&vd.vd_next_tsc, __ATOMIC_RELAXED);
+	if (base_tsc < next || prev_sys == 0 ||
+	    base_tsc - prev_tsc > 2 * (uint64_t)approx_cpu_hz / MILLISEC)
+		return;
+
+	/* One thread per period. */
+	if (!__atomic_compare_exchange_n(&vd.vd_next_tsc, &next,
+	    base_tsc + validate_period_tsc, 0, __ATOMIC_RELAXED,
+	    __ATOMIC_RELAXED))
+		return;
+
+	delta.tsc_64 = base_tsc - prev_tsc;
+	TSC_CONVERT(delta, prev_scale);
+	err = (int64_t)(prev_sys + delta.tsc_64 - base_sys);
+	abs_err = (err < 0) ? (uint64_t)-err : (uint64_t)err;
+
+	__atomic_fetch_add(&vd.vd_stats.vs_samples, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&vd.vd_stats.vs_sum_err_ns, abs_err,
+	    __ATOMIC_RELAXED);
+	__atomic_store_n(&vd.vd_stats.vs_last_err_ns, err, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&vd.vd_stats.vs_max_err_ns, __ATOMIC_RELAXED);
+	while (abs_err > max && !__atomic_compare_exchange_n(
+	    &vd.vd_stats.vs_max_err_ns, &max, abs_err, 0, __ATOMIC_RELAXED,
+	    __ATOMIC_RELAXED))
+		;
+
+	/* The next check retries, with the same reference. */
+	if (sample_monotonic(&tsc, &kern_ns) != 0)
+		return;
+
+	if (abs_err <= validate_max_ns) {
+		vd.vd_over = 0;
+		vd.vd_recal = 0;
+	} else {
+		__atomic_fetch_add(&vd.vd_stats.vs_breaches, 1,
+		    __ATOMIC_RELAXED);
+
+		if (++vd.vd_over >= VALIDATE_OVER) {
+			vd.vd_over = 0;
+
+			/*
+			 * A breach that can't be recalibrated (the
+			 * reference is too old, as with checks a minute
+			 * or more apart) goes straight to passthrough.
+			 */
+			if (validate_action == VALIDATE_PASSTHROUGH) {
+				set_passthrough();
+			} else if (validate_action == VALIDATE_RECALIBRATE) {
+				if (vd.vd_recal > 0 ||
+				    recalibrate(kern_ns, tsc) != 0)
+					set_passthrough();
+				else
+					vd.vd_recal++;
+			}
+		}
+	}
+
+	vd.vd_ref_tsc = tsc;
+	vd.vd_ref_ns = kern_ns;
+}
+
+/*
+ * Nanoseconds since Unix epoch from the thread's local clock.
+ */
+FT_INLINE uint64_t
+realtime_ns()
+{
+	unsigned int a, d;
+	uint64_t prev_sys, prev_tsc, prev_scale;
+	tscu_t tsc;
 
 	/*
 	 * Grab the value in the TSC register, calculate delta since
-	 * the library was loaded, and then convert cycle count to
-	 * nanoseconds; after which the tsc variable will contain
-	 * nanoseconds since library load.
+	 * the last sync, and then convert cycle count to nanoseconds;
+	 * after which the tsc variable will contain nanoseconds since
+	 * last sync.
 	 */
 	__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
 	tsc.tsc_64 = (((uint64_t)a) | ((uint64_t)d) << 32) - base_tsc;
-	TSC_CONVERT(tsc, nsec_scale);
+	TSC_CONVERT(tsc, base_scale);
 
 	/*
 	 * Synchonize local clock with system if it's been more than
-	 * 1ms since last sync.
+	 * 1ms since last sync (always, in passthrough).
 	 */
-	if (tsc.tsc_64 >= (1 * (NANOSEC / MILLISEC))) {
+	if (tsc.tsc_64 >= base_sync_nsec) {
+		prev_sys = base_sys;
+		prev_tsc = base_tsc;
+		prev_scale = base_scale;
 		sync_local_clock();
-		tp->tv_sec = base_ts.tv_sec;
-		tp->tv_usec = base_ts.tv_nsec / 1000;
-	} else {
-		/* Add the nanoseconds since local sync to the system
-		 * clock nanoseconds value which was also read at last
-		 * sync: producing nanoseconds since Unix epoch. Then
-		 * convert this number into a timeval structure.
-		 */
-		tsc.tsc_64 += base_sys;
-		tp->tv_sec = tsc.tsc_64 / NANOSEC;
-		tp->tv_usec = (tsc.tsc_64 % NANOSEC) / 1000;
+		if (validate_period_tsc != 0)
+			validate_local_clock(prev_sys, prev_tsc, prev_scale);
+		return (base_sys);
 	}
 
+	/*
+	 * Add the nanoseconds since local sync to the system clock
+	 * nanoseconds value which was also read at last sync:
+	 * producing nanoseconds since Unix epoch.
+	 */
+	return (tsc.tsc_64 + base_sys);
+}
 
-	/* Assert that an impossible timeval was not generated. */
-	assert(tp->tv_sec > -1);
-	assert(tp->tv_usec > -1);
-	assert(tp->tv_usec < MICROSEC);
+/*
+ * Nanoseconds on the kernel's CLOCK_MONOTONIC timeline, extrapolated
+ * from this node's replica of the anchor. The TSC is read first, to
+ * know the node; if the anchor is republished in between, now is
+ * before its ms_tsc and mono_extrapolate() returns ms_ns.
+ */
+FT_INLINE uint64_t
+monotonic_ns(int numa)
+{
+	uint64_t now;
+	node_state_t *nd;
+	mono_snap_t snap;
 
-	return (0);
+	now = rdtsc_node(&nd, numa);
+	mono_read(&nd->nd_mono, &snap);
+
+	if (now >= snap.ms_next_tsc)
+		return (sync_monotonic(now, nd));
+
+	return (mono_extrapolate(&snap, now));
 }
 
 #ifdef __sun
@@ -328,34 +1064,66 @@ gethrtime()
 
 	__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
 	tsc.tsc_64 = (((hrtime_t)a) | ((hrtime_t)d) << 32);
-	TSC_CONVERT(tsc, nsec_scale);
+	TSC_CONVERT(tsc, tsc_scale);
 
 	return ((hrtime_t)tsc.tsc_64);
 }
 
 #endif
 
-int
-clock_gettime(clockid_t clock_id, struct timespec *tp)
+/*
+ * C++ std::chrono clocks. These are the mangled names of now() in
+ * libstdc++ (the _V2 inline namespace, GCC >= 4.8) and libc++
+ * (std::__1). Depending on how the C++ runtime was built they reach
+ * the kernel through syscall(SYS_clock_gettime) or internal aliases
+ * rather than clock_gettime(), so they are interposed directly.
+ *
+ * Each returns a std::chrono::time_point, a trivially copyable class
+ * holding a single 64-bit count; ft_chrono_tp_t has the same layout
+ * so it is returned the same way on both i386 and amd64.
+ */
+typedef struct ft_chrono_tp {
+	int64_t	ct_count;
+} ft_chrono_tp_t;
+
+/*
+ * TSC backend for each entry point. These are always inlined into
+ * the ifunc targets, see FT_TSC_VARIANT.
+ */
+FT_INLINE int
+#ifdef __sun
+gettimeofday_tsc(struct timeval *tp, void __attribute__((unused)) *tzp)
+#elif __linux
+gettimeofday_tsc(struct timeval *tp, struct timezone __attribute__((unused)) *tz)
+#endif
 {
-	unsigned int a, d;
-	tscu_t tsc;
+	uint64_t ns;
+
+	if (tp == NULL)
+		return (0);
+
+	ns = realtime_ns();
+	tp->tv_sec = ns / NANOSEC;
+	tp->tv_usec = (ns % NANOSEC) / 1000;
+
+	/* Assert that an impossible timeval was not generated. */
+	assert(tp->tv_sec > -1);
+	assert(tp->tv_usec > -1);
+	assert(tp->tv_usec < MICROSEC);
+
+	return (0);
+}
+
+FT_INLINE int
+clock_gettime_tsc(clockid_t clock_id, struct timespec *tp, int numa)
+{
+	uint64_t ns;
 
 	switch (clock_id) {
 	case CLOCK_REALTIME:
-		__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
-		tsc.tsc_64 = (((uint64_t)a) | ((uint64_t)d) << 32) - base_tsc;
-		TSC_CONVERT(tsc, nsec_scale);
-
-		if (tsc.tsc_64 >= (1 * (NANOSEC / MILLISEC))) {
-			sync_local_clock();
-			tp->tv_sec = base_ts.tv_sec;
-			tp->tv_nsec = base_ts.tv_nsec;
-		} else {
-			tsc.tsc_64 += base_sys;
-			tp->tv_sec = tsc.tsc_64 / NANOSEC;
-			tp->tv_nsec = tsc.tsc_64 % NANOSEC;
-		}
+		ns = realtime_ns();
+		tp->tv_sec = ns / NANOSEC;
+		tp->tv_nsec = ns % NANOSEC;
 
 		assert(tp->tv_sec > -1);
 		assert(tp->tv_nsec > -1);
@@ -364,12 +1132,9 @@ clock_gettime(clockid_t clock_id, struct timespec *tp)
 		break;
 
 	case CLOCK_MONOTONIC:
-		__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
-		tsc.tsc_64 = (((uint64_t)a) | ((uint64_t)d) << 32);
-		TSC_CONVERT(tsc, nsec_scale);
-
-		tp->tv_sec = tsc.tsc_64 / NANOSEC;
-		tp->tv_nsec = tsc.tsc_64 % NANOSEC;
+		ns = monotonic_ns(numa);
+		tp->tv_sec = ns / NANOSEC;
+		tp->tv_nsec = ns % NANOSEC;
 
 		assert(tp->tv_sec > -1);
 		assert(tp->tv_nsec > -1);
@@ -378,9 +1143,478 @@ clock_gettime(clockid_t clock_id, struct timespec *tp)
 		break;
 
 	default:
+		if (_sys_clock_gettime == NULL)
+			_init_fasttime();
 		_sys_clock_gettime(clock_id, tp);
 		break;
 	}
 
 	return (0);
 }
+
+/* std::chrono::_V2::system_clock, nanoseconds */
+FT_INLINE ft_chrono_tp_t
+system_clock_now_tsc()
+{
+	ft_chrono_tp_t tp;
+
+	tp.ct_count = (int64_t)realtime_ns();
+
+	return (tp);
+}
+
+/* std::__1::chrono::system_clock, microseconds */
+FT_INLINE ft_chrono_tp_t
+libcxx_system_clock_now_tsc()
+{
+	ft_chrono_tp_t tp;
+
+	tp.ct_count = (int64_t)(realtime_ns() / 1000);
+
+	return (tp);
+}
+
+/* steady_clock, nanoseconds in both runtimes */
+FT_INLINE ft_chrono_tp_t
+steady_clock_now_tsc(int numa)
+{
+	ft_chrono_tp_t tp;
+
+	tp.ct_count = (int64_t)monotonic_ns(numa);
+
+	return (tp);
+}
+
+/*
+ * Fetch-max of ns into the global unique counter: ns itself if it is
+ * past everything handed out so far, otherwise one more than the
+ * latest value.
+ */
+FT_INLINE uint64_t
+unique_next(uint64_t ns)
+{
+	uint64_t last, next;
+
+	last = __atomic_load_n(&unique.ul_ns, __ATOMIC_RELAXED);
+	do {
+		next = (ns > last) ? ns : last + 1;
+	} while (!__atomic_compare_exchange_n(&unique.ul_ns, &last, next, 0,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return (next);
+}
+
+/*
+ * Same for a shard: ns with its low bits replaced by the shard id,
+ * bumped to the next multiple past the shard's last value if needed.
+ * Only the shard's owner writes its line, so no CAS is needed. A
+ * shard out of range gets 0.
+ */
+FT_INLINE uint64_t
+unique_shard_next(uint64_t ns, unsigned int shard)
+{
+	unique_last_t *ul;
+	uint64_t hi, last_hi;
+
+	if (shard > FT_UNIQUE_SHARD_MAX)
+		return (0);
+
+	ul = &unique_shard[shard];
+	hi = ns >> FT_UNIQUE_SHARD_BITS;
+	last_hi = __atomic_load_n(&ul->ul_ns, __ATOMIC_RELAXED) >>
+	    FT_UNIQUE_SHARD_BITS;
+	if (hi <= last_hi)
+		hi = last_hi + 1;
+
+	ns = (hi << FT_UNIQUE_SHARD_BITS) | shard;
+	__atomic_store_n(&ul->ul_ns, ns, __ATOMIC_RELAXED);
+
+	return (ns);
+}
+
+FT_INLINE uint64_t
+unique_ns_tsc()
+{
+	return (unique_next(realtime_ns()));
+}
+
+FT_INLINE uint64_t
+unique_ns_shard_tsc(unsigned int shard)
+{
+	return (unique_shard_next(realtime_ns(), shard));
+}
+
+FT_INLINE uint64_t
+tsc_to_ns(uint64_t tsc)
+{
+	tscu_t t;
+
+	t.tsc_64 = tsc;
+	TSC_CONVERT(t, tsc_scale);
+
+	return (t.tsc_64);
+}
+
+uint64_t
+ft_tsc_hz(void)
+{
+	return ((uint64_t)approx_cpu_hz);
+}
+
+void
+ft_validate_stats(ft_validate_stats_t *stats)
+{
+	ft_validate_stats_t *vs = &vd.vd_stats;
+
+	stats->vs_samples = __atomic_load_n(&vs->vs_samples, __ATOMIC_RELAXED);
+	stats->vs_breaches =
+	    __atomic_load_n(&vs->vs_breaches, __ATOMIC_RELAXED);
+	stats->vs_recalibrations =
+	    __atomic_load_n(&vs->vs_recalibrations, __ATOMIC_RELAXED);
+	stats->vs_last_err_ns =
+	    __atomic_load_n(&vs->vs_last_err_ns, __ATOMIC_RELAXED);
+	stats->vs_max_err_ns =
+	    __atomic_load_n(&vs->vs_max_err_ns, __ATOMIC_RELAXED);
+	stats->vs_sum_err_ns =
+	    __atomic_load_n(&vs->vs_sum_err_ns, __ATOMIC_RELAXED);
+	stats->vs_passthrough =
+	    __atomic_load_n(&vs->vs_passthrough, __ATOMIC_RELAXED);
+}
+
+#ifdef __linux
+
+/*
+ * Passthrough backend, used when the TSC can't be trusted. Every call
+ * goes to the system.
+ */
+static int
+gettimeofday_pass(struct timeval *tp, struct timezone *tz)
+{
+	if (_sys_gettimeofday == NULL)
+		_init_fasttime();
+
+	return (_sys_gettimeofday(tp, tz));
+}
+
+static int
+clock_gettime_pass(clockid_t clock_id, struct timespec *tp)
+{
+	if (_sys_clock_gettime == NULL)
+		_init_fasttime();
+
+	return (_sys_clock_gettime(clock_id, tp));
+}
+
+static uint64_t
+sys_ns(clockid_t clock_id)
+{
+	struct timespec ts;
+
+	if (_sys_clock_gettime == NULL)
+		_init_fasttime();
+
+	(void) _sys_clock_gettime(clock_id, &ts);
+
+	return (((uint64_t)ts.tv_sec * NANOSEC) + ts.tv_nsec);
+}
+
+static ft_chrono_tp_t
+system_clock_now_pass()
+{
+	ft_chrono_tp_t tp;
+
+	tp.ct_count = (int64_t)sys_ns(CLOCK_REALTIME);
+
+	return (tp);
+}
+
+static ft_chrono_tp_t
+libcxx_system_clock_now_pass()
+{
+	ft_chrono_tp_t tp;
+
+	tp.ct_count = (int64_t)(sys_ns(CLOCK_REALTIME) / 1000);
+
+	return (tp);
+}
+
+static ft_chrono_tp_t
+steady_clock_now_pass()
+{
+	ft_chrono_tp_t tp;
+
+	tp.ct_count = (int64_t)sys_ns(CLOCK_MONOTONIC);
+
+	return (tp);
+}
+
+static uint64_t
+unique_ns_pass()
+{
+	return (unique_next(sys_ns(CLOCK_REALTIME)));
+}
+
+static uint64_t
+unique_ns_shard_pass(unsigned int shard)
+{
+	return (unique_shard_next(sys_ns(CLOCK_REALTIME), shard));
+}
+
+/*
+ * Instantiate the TSC backend as the ifunc targets name_sfx. numa is
+ * passed on to rdtsc_node().
+ */
+#define	FT_TSC_VARIANT(sfx, numa)					\
+static int								\
+gettimeofday_##sfx(struct timeval *tp, struct timezone *tz)		\
+{									\
+	return (gettimeofday_tsc(tp, tz));				\
+}									\
+									\
+static int								\
+clock_gettime_##sfx(clockid_t clock_id, struct timespec *tp)		\
+{									\
+	return (clock_gettime_tsc(clock_id, tp, numa));			\
+}									\
+									\
+static ft_chrono_tp_t						\
+system_clock_now_##sfx()						\
+{									\
+	return (system_clock_now_tsc());				\
+}									\
+									\
+static ft_chrono_tp_t						\
+libcxx_system_clock_now_##sfx()						\
+{									\
+	return (libcxx_system_clock_now_tsc());				\
+}									\
+									\
+static ft_chrono_tp_t						\
+steady_clock_now_##sfx()						\
+{									\
+	return (steady_clock_now_tsc(numa));				\
+}									\
+									\
+static uint64_t							\
+tsc_to_ns_##sfx(uint64_t tsc)						\
+{									\
+	return (tsc_to_ns(tsc));					\
+}									\
+									\
+static uint64_t							\
+unique_ns_##sfx()							\
+{									\
+	return (unique_ns_tsc());					\
+}									\
+									\
+static uint64_t							\
+unique_ns_shard_##sfx(unsigned int shard)				\
+{									\
+	return (unique_ns_shard_tsc(shard));				\
+}
+
+FT_TSC_VARIANT(generic, 0)
+FT_TSC_VARIANT(numa, 1)
+
+enum ft_impl {
+	FT_IMPL_PASS = 0,	/* passthrough to the system */
+	FT_IMPL_TSC,		/* TSC, one node */
+	FT_IMPL_TSC_NUMA	/* TSC, node state replicated per node */
+};
+
+/*
+ * Pick the implementation for this CPU. Called from the resolvers,
+ * possibly during relocation and before any constructor has run, so
+ * it may only look at CPUID and make raw system calls.
+ */
+static enum ft_impl
+select_impl()
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	/*
+	 * CPUID.80000007H:EDX[8] -- presence of invariant TSC
+	 *
+	 * Without it the TSC may change rate or stop across P- and
+	 * C-state transitions, fall back to the system.
+	 */
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 ||
+	    (edx & 0x100) == 0)
+		return (FT_IMPL_PASS);
+
+	return (count_nodes() > 1 ? FT_IMPL_TSC_NUMA : FT_IMPL_TSC);
+}
+
+/*
+ * Generate the ifunc resolver for an entry point. pass is the
+ * passthrough, the TSC variants of name are name_generic and
+ * name_numa.
+ */
+#define	FT_RESOLVER(name, pass, type)					\
+static type								\
+name##_resolve()							\
+{									\
+	switch (select_impl()) {					\
+	case FT_IMPL_PASS:						\
+		return (pass);						\
+	case FT_IMPL_TSC_NUMA:						\
+		return (name##_numa);					\
+	default:							\
+		return (name##_generic);				\
+	}								\
+}
+
+typedef int (*gettimeofday_fn)(struct timeval *, struct timezone *);
+typedef int (*clock_gettime_fn)(clockid_t, struct timespec *);
+typedef ft_chrono_tp_t (*chrono_now_fn)();
+typedef uint64_t (*tsc_to_ns_fn)(uint64_t);
+typedef uint64_t (*unique_ns_fn)();
+typedef uint64_t (*unique_ns_shard_fn)(unsigned int);
+
+FT_RESOLVER(gettimeofday, gettimeofday_pass, gettimeofday_fn)
+FT_RESOLVER(clock_gettime, clock_gettime_pass, clock_gettime_fn)
+FT_RESOLVER(system_clock_now, system_clock_now_pass, chrono_now_fn)
+FT_RESOLVER(libcxx_system_clock_now, libcxx_system_clock_now_pass,
+    chrono_now_fn)
+FT_RESOLVER(steady_clock_now, steady_clock_now_pass, chrono_now_fn)
+FT_RESOLVER(tsc_to_ns, tsc_to_ns_generic, tsc_to_ns_fn)
+FT_RESOLVER(unique_ns, unique_ns_pass, unique_ns_fn)
+FT_RESOLVER(unique_ns_shard, unique_ns_shard_pass, unique_ns_shard_fn)
+
+/*
+ * Generate name_ptr, the implementation the interposed entry point
+ * calls through. It starts out as name_first, which runs the resolver
+ * on the first call and replaces itself with the result.
+ */
+#define	FT_INDIRECT(name, type, rtype, params, args)			\
+static rtype name##_first params;					\
+static type name##_ptr = name##_first;					\
+									\
+static rtype								\
+name##_first params							\
+{									\
+	type fn = name##_resolve();					\
+									\
+	__atomic_store_n(&name##_ptr, fn, __ATOMIC_RELAXED);		\
+	return (fn args);						\
+}
+
+FT_INDIRECT(gettimeofday, gettimeofday_fn, int,
+    (struct timeval *tp, struct timezone *tz), (tp, tz))
+FT_INDIRECT(clock_gettime, clock_gettime_fn, int,
+    (clockid_t clock_id, struct timespec *tp), (clock_id, tp))
+FT_INDIRECT(system_clock_now, chrono_now_fn, ft_chrono_tp_t, (), ())
+FT_INDIRECT(libcxx_system_clock_now, chrono_now_fn, ft_chrono_tp_t, (), ())
+FT_INDIRECT(steady_clock_now, chrono_now_fn, ft_chrono_tp_t, (), ())
+
+/*
+ * The entry points interposed on the system's are plain functions
+ * calling through a pointer: the dynamic linker relocates other
+ * objects before a preloaded one, and those importing an ifunc symbol
+ * from it with -z now get a warning to relink at every start. The
+ * library's own ft_* entry points are ifuncs, bound once at load time
+ * to the implementation their resolver picked. Either way neither the
+ * backend nor the CPU features are checked on the call path.
+ */
+int
+gettimeofday(struct timeval *tp, struct timezone *tz)
+{
+	return (__atomic_load_n(&gettimeofday_ptr, __ATOMIC_RELAXED)(tp, tz));
+}
+
+int
+clock_gettime(clockid_t clock_id, struct timespec *tp)
+{
+	return (__atomic_load_n(&clock_gettime_ptr, __ATOMIC_RELAXED)(
+	    clock_id, tp));
+}
+
+ft_chrono_tp_t
+_ZNSt6chrono3_V212system_clock3nowEv()
+{
+	return (__atomic_load_n(&system_clock_now_ptr, __ATOMIC_RELAXED)());
+}
+
+ft_chrono_tp_t
+_ZNSt6chrono3_V212steady_clock3nowEv()
+{
+	return (__atomic_load_n(&steady_clock_now_ptr, __ATOMIC_RELAXED)());
+}
+
+ft_chrono_tp_t
+_ZNSt3__16chrono12system_clock3nowEv()
+{
+	return (__atomic_load_n(&libcxx_system_clock_now_ptr,
+	    __ATOMIC_RELAXED)());
+}
+
+ft_chrono_tp_t
+_ZNSt3__16chrono12steady_clock3nowEv()
+{
+	return (__atomic_load_n(&steady_clock_now_ptr, __ATOMIC_RELAXED)());
+}
+
+uint64_t ft_tsc_to_ns(uint64_t tsc)
+    __attribute__((ifunc("tsc_to_ns_resolve")));
+uint64_t ft_unique_ns(void)
+    __attribute__((ifunc("unique_ns_resolve")));
+uint64_t ft_unique_ns_shard(unsigned int shard)
+    __attribute__((ifunc("unique_ns_shard_resolve")));
+
+#elif __sun
+
+int
+gettimeofday(struct timeval *tp, void *tzp)
+{
+	return (gettimeofday_tsc(tp, tzp));
+}
+
+int
+clock_gettime(clockid_t clock_id, struct timespec *tp)
+{
+	return (clock_gettime_tsc(clock_id, tp, 0));
+}
+
+ft_chrono_tp_t
+_ZNSt6chrono3_V212system_clock3nowEv()
+{
+	return (system_clock_now_tsc());
+}
+
+ft_chrono_tp_t
+_ZNSt6chrono3_V212steady_clock3nowEv()
+{
+	return (steady_clock_now_tsc(0));
+}
+
+ft_chrono_tp_t
+_ZNSt3__16chrono12system_clock3nowEv()
+{
+	return (libcxx_system_clock_now_tsc());
+}
+
+ft_chrono_tp_t
+_ZNSt3__16chrono12steady_clock3nowEv()
+{
+	return (steady_clock_now_tsc(0));
+}
+
+uint64_t
+ft_tsc_to_ns(uint64_t tsc)
+{
+	return (tsc_to_ns(tsc));
+}
+
+uint64_t
+ft_unique_ns(void)
+{
+	return (unique_ns_tsc());
+}
+
+uint64_t
+ft_unique_ns_shard(unsigned int shard)
+{
+	return (unique_ns_shard_tsc(shard));
+}
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2015 Lucera Financial Infrastructure, LLC
+ *
+ * This software may be modified and distributed under the terms of
+ * the MIT license. See the LICENSE file for details.
+ */
+
+/*
+ * Public interface to libfasttime beyond the overridden system
+ * functions. Everything here is prefixed ft_ and is only available
+ * when linking against (or preloading) libfasttime.so.
+ */
+#ifndef _FASTTIME_H
+#define	_FASTTIME_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The TSC frequency, in Hz, that libfasttime calibrated against at
+ * load time. It stays that value even after shadow validation finds
+ * the calibration off and recalibrates or falls back to passthrough,
+ * and so do ft_tsc_to_ns(), the timer wheel's timeouts and
+ * fasttime::tsc_clock (without FASTTIME_TSC_HZ) built on it.
+ */
+extern uint64_t ft_tsc_hz(void);
+
+/*
+ * Convert a TSC value (cycles) to nanoseconds using the library's
+ * load time calibration. Shadow validation recalibrating the clocks
+ * doesn't change it, so the result only ever moves with the TSC, but
+ * a bad load time calibration stays in it.
+ */
+extern uint64_t ft_tsc_to_ns(uint64_t tsc);
+
+/*
+ * Shadow validation summary, see FASTTIME_VALIDATE in the README.
+ * Errors are the fast path's CLOCK_REALTIME minus the kernel's.
+ */
+typedef struct ft_validate_stats {
+	uint64_t	vs_samples;		/* checks done */
+	uint64_t	vs_breaches;		/* checks over the threshold */
+	uint64_t	vs_recalibrations;
+	int64_t		vs_last_err_ns;
+	uint64_t	vs_max_err_ns;		/* absolute */
+	uint64_t	vs_sum_err_ns;		/* absolute, for the mean */
+	int		vs_passthrough;		/* switched to passthrough */
+} ft_validate_stats_t;
+
+extern void ft_validate_stats(ft_validate_stats_t *stats);
+
+/*
+ * Unique timestamps, e.g. for IDs.
+ *
+ * ft_unique_ns() returns CLOCK_REALTIME nanoseconds, strictly greater
+ * than every value it has returned before to any thread in the
+ * process. When two calls land on the same nanosecond (or a thread's
+ * clock is behind another's) the later one gets the previous value
+ * plus one, so under sustained bursts the values run slightly ahead
+ * of the clock. It costs one CAS on a shared cache line per call.
+ *
+ * ft_unique_ns_shard() avoids the shared line: the low
+ * FT_UNIQUE_SHARD_BITS bits of the timestamp are replaced with shard,
+ * and values only increase strictly within the shard. They are unique
+ * across the process as long as no two threads use the same shard at
+ * the same time, but are not ordered between shards and resolution
+ * is 2^FT_UNIQUE_SHARD_BITS nanoseconds. shard must be between 0 and
+ * FT_UNIQUE_SHARD_MAX, for any other value 0 is returned.
+ */
+#define	FT_UNIQUE_SHARD_BITS	8
+#define	FT_UNIQUE_SHARD_MAX	((1U << FT_UNIQUE_SHARD_BITS) - 1)
+
+extern uint64_t ft_unique_ns(void);
+extern uint64_t ft_unique_ns_shard(unsigned int shard);
+
+/*
+ * Hierarchical timer wheel driven directly by the TSC.
+ *
+ * Timers are scheduled and expired in ticks of 2^n TSC cycles, the
+ * library's calibration is only used to turn nanosecond timeouts into
+ * cycles. Insert and cancel are O(1); ft_timer_wheel_poll() is a
+ * single RDTSC and compare when nothing is due, otherwise it expires
+ * every due timer in one pass.
+ *
+ * Timers are intrusive: embed an ft_timer_t in your own structure.
+ * A wheel is not thread-safe, use one per thread (event loop).
+ */
+#define	FT_WHEEL_BITS		8
+#define	FT_WHEEL_SLOTS		(1 << FT_WHEEL_BITS)
+#define	FT_WHEEL_LEVELS		4
+
+typedef struct ft_timer ft_timer_t;
+typedef void (*ft_timer_cb_t)(ft_timer_t *timer, void *arg);
+
+struct ft_timer {
+	ft_timer_t	*tm_next;	/* next in slot */
+	ft_timer_t	**tm_pprev;	/* prev's next, NULL if not pending */
+	uint64_t	tm_expire;	/* expiry tick */
+	ft_timer_cb_t	tm_cb;
+	void		*tm_arg;
+};
+
+typedef struct ft_timer_wheel {
+	uint64_t	tw_next_tsc;	/* poll is a no-op before this */
+	uint64_t	tw_now;		/* next tick to be processed */
+	uint64_t	tw_ns_scale;	/* ns to cycles, 36.28 fixed point */
+	unsigned int	tw_shift;	/* tick is 2^tw_shift cycles */
+	unsigned int	tw_count;	/* pending timers */
+	/* non-empty slots */
+	uint64_t	tw_bitmap[FT_WHEEL_LEVELS][FT_WHEEL_SLOTS / 64];
+	ft_timer_t	*tw_slots[FT_WHEEL_LEVELS][FT_WHEEL_SLOTS];
+} ft_timer_wheel_t;
+
+/*
+ * Initialize a wheel with a tick of resolution_ns, rounded down to a
+ * power of two cycles.
+ */
+extern void ft_timer_wheel_init(ft_timer_wheel_t *tw, uint64_t resolution_ns);
+
+extern void ft_timer_init(ft_timer_t *timer, ft_timer_cb_t cb, void *arg);
+
+/*
+ * Schedule timer to fire timeout_ns from now, or at the absolute TSC
+ * value expire_tsc. A pending timer is rescheduled. Timers never fire
+ * early and at most one tick late (plus however late the poll is).
+ */
+extern void ft_timer_add(ft_timer_wheel_t *tw, ft_timer_t *timer,
+    uint64_t timeout_ns);
+extern void ft_timer_add_tsc(ft_timer_wheel_t *tw, ft_timer_t *timer,
+    uint64_t expire_tsc);
+
+extern void ft_timer_cancel(ft_timer_wheel_t *tw, ft_timer_t *timer);
+extern int ft_timer_pending(const ft_timer_t *timer);
+
+/*
+ * Run the callback of every timer that is due, returns the number
+ * run. Callbacks may add and cancel timers, including their own.
+ */
+extern unsigned int ft_timer_wheel_poll(ft_timer_wheel_t *tw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FASTTIME_H */
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2015 Lucera Financial Infrastructure, LLC
+ *
+ * This software may be modified and distributed under the terms of
+ * the MIT license. See the LICENSE file for details.
+ */
+
+/*
+ * std::chrono compatible clocks on top of libfasttime. All three
+ * clocks meet the TrivialClock requirements and can be used anywhere
+ * a std::chrono clock is expected.
+ *
+ * realtime_clock
+ *
+ *	CLOCK_REALTIME through the libfasttime clock_gettime().
+ *
+ * steady_clock
+ *
+ *	CLOCK_MONOTONIC through the libfasttime clock_gettime().
+ *
+ * tsc_clock
+ *
+ *	The raw TSC. If FASTTIME_TSC_HZ is defined at compile time
+ *	(pinned hardware) the duration is in TSC cycles and conversion
+ *	to nanoseconds is an exact constexpr duration_cast. Otherwise
+ *	the frequency is only known at runtime and the duration is
+ *	nanoseconds on the TSC timeline, converted using the library's
+ *	calibration.
+ *
+ * Use fasttime::clock_cast<Dst>(tp) to convert a time_point between
+ * any two of these (or the std::chrono clocks).
+ */
+#ifndef _FASTTIME_HPP
+#define	_FASTTIME_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <ratio>
+#include <time.h>
+
+#include "fasttime.h"
+
+namespace fasttime {
+
+namespace detail {
+
+constexpr std::uint64_t nanosec = 1000000000ULL;
+
+inline std::uint64_t
+rdtsc() noexcept
+{
+	unsigned int a, d;
+
+	__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
+
+	return (((std::uint64_t)a) | ((std::uint64_t)d) << 32);
+}
+
+/*
+ * How to move a clock's duration to and from nanoseconds.
+ */
+template <class Clock>
+struct clock_traits {
+	static constexpr std::chrono::nanoseconds
+	to_ns(typename Clock::duration d) noexcept
+	{
+		return (std::chrono::duration_cast<
+		    std::chrono::nanoseconds>(d));
+	}
+
+	static constexpr typename Clock::duration
+	from_ns(std::chrono::nanoseconds d) noexcept
+	{
+		return (std::chrono::duration_cast<
+		    typename Clock::duration>(d));
+	}
+};
+
+} /* namespace detail */
+
+class realtime_clock {
+public:
+	typedef std::chrono::nanoseconds		duration;
+	typedef duration::rep				rep;
+	typedef duration::period			period;
+	typedef std::chrono::time_point<realtime_clock>	time_point;
+
+	static constexpr bool is_steady = false;
+
+	static time_point
+	now() noexcept
+	{
+		struct timespec ts;
+
+		(void) ::clock_gettime(CLOCK_REALTIME, &ts);
+
+		return (time_point(duration(
+		    (rep)ts.tv_sec * (rep)detail::nanosec + ts.tv_nsec)));
+	}
+
+	static std::time_t
+	to_time_t(const time_point &t) noexcept
+	{
+		return ((std::time_t)std::chrono::duration_cast<
+		    std::chrono::seconds>(t.time_since_epoch()).count());
+	}
+
+	static time_point
+	from_time_t(std::time_t t) noexcept
+	{
+		return (time_point(std::chrono::seconds(t)));
+	}
+};
+
+class steady_clock {
+public:
+	typedef std::chrono::nanoseconds		duration;
+	typedef duration::rep				rep;
+	typedef duration::period			period;
+	typedef std::chrono::time_point<steady_clock>	time_point;
+
+	static constexpr bool is_steady = true;
+
+	static time_point
+	now() noexcept
+	{
+		struct timespec ts;
+
+		(void) ::clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		return (time_point(duration(
+		    (rep)ts.tv_sec * (rep)detail::nanosec + ts.tv_nsec)));
+	}
+};
+
+/*
+ * TSC clock with a frequency fixed at compile time. The duration is
+ * in cycles; to_nanoseconds() and from_nanoseconds() are exact
+ * duration_casts, a multiply and divide by the reduced ratio of Hz to
+ * 1GHz. As with any duration_cast the count times the numerator has
+ * to fit in 64 bits, so a round Hz (e.g. in kHz) keeps the range up.
+ */
+template <std::uint64_t Hz>
+class basic_tsc_clock {
+	static_assert(Hz > 0, "TSC frequency must be non-zero");
+
+public:
+	typedef std::int64_t					rep;
+	typedef std::ratio<1, (std::intmax_t)Hz>		period;
+	typedef std::chrono::duration<rep, period>		duration;
+	typedef std::chrono::time_point<basic_tsc_clock>	time_point;
+
+	static constexpr bool is_steady = true;
+	static constexpr std::uint64_t frequency = Hz;
+
+	static time_point
+	now() noexcept
+	{
+		return (time_point(duration((rep)detail::rdtsc())));
+	}
+
+	static constexpr std::chrono::nanoseconds
+	to_nanoseconds(duration d) noexcept
+	{
+		return (std::chrono::duration_cast<
+		    std::chrono::nanoseconds>(d));
+	}
+
+	static constexpr duration
+	from_nanoseconds(std::chrono::nanoseconds d) noexcept
+	{
+		return (std::chrono::duration_cast<duration>(d));
+	}
+};
+
+/*
+ * TSC clock with the frequency only known at runtime. A ratio can't
+ * be expressed for it, so the duration is nanoseconds on the TSC
+ * timeline using libfasttime's calibration. The raw cycle count is
+ * available via ticks().
+ */
+template <>
+class basic_tsc_clock<0> {
+public:
+	typedef std::chrono::nanoseconds			duration;
+	typedef duration::rep					rep;
+	typedef duration::period				period;
+	typedef std::chrono::time_point<basic_tsc_clock>	time_point;
+
+	static constexpr bool is_steady = true;
+
+	static std::uint64_t
+	ticks() noexcept
+	{
+		return (detail::rdtsc());
+	}
+
+	static time_point
+	now() noexcept
+	{
+		return (time_point(duration((rep)ft_tsc_to_ns(ticks()))));
+	}
+};
+
+#ifdef FASTTIME_TSC_HZ
+typedef basic_tsc_clock<FASTTIME_TSC_HZ>	tsc_clock;
+#else
+typedef basic_tsc_clock<0>			tsc_clock;
+#endif
+
+namespace detail {
+
+template <>
+struct clock_traits<basic_tsc_clock<0> > :
+    clock_traits<steady_clock> {
+};
+
+/*
+ * The clocks have unrelated epochs so both are sampled back-to-back
+ * and the offset of t from the source's now() is applied to the
+ * destination's now().
+ */
+template <class DstClock, class SrcClock>
+struct clock_caster {
+	template <class Duration>
+	static typename DstClock::time_point
+	cast(const std::chrono::time_point<SrcClock, Duration> &t)
+	{
+		typename SrcClock::time_point src_now = SrcClock::now();
+		typename DstClock::time_point dst_now = DstClock::now();
+		std::chrono::nanoseconds delta = clock_traits<SrcClock>::to_ns(
+		    std::chrono::time_point_cast<
+		    typename SrcClock::duration>(t) - src_now);
+
+		return (dst_now + clock_traits<DstClock>::from_ns(delta));
+	}
+};
+
+/* Same clock, nothing to sample. */
+template <class Clock>
+struct clock_caster<Clock, Clock> {
+	template <class Duration>
+	static typename Clock::time_point
+	cast(const std::chrono::time_point<Clock, Duration> &t)
+	{
+		return (std::chrono::time_point_cast<
+		    typename Clock::duration>(t));
+	}
+};
+
+} /* namespace detail */
+
+/*
+ * Convert a time_point from one clock to another.
+ */
+template <class DstClock, class SrcClock, class Duration>
+typename DstClock::time_point
+clock_cast(const std::chrono::time_point<SrcClock, Duration> &t)
+{
+	return (detail::clock_caster<DstClock, SrcClock>::cast(t));
+}
+
+} /* namespace fasttime */
+
+#endif /* _FASTTIME_HPP */
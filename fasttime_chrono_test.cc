@@ -0,0 +1,175 @@
+/*
+ * Copyright 2015 Lucera Financial Infrastructure, LLC
+ *
+ * This software may be modified and distributed under the terms of
+ * the MIT license. See the LICENSE file for details.
+ */
+
+/*
+ * Verify that an unmodified C++ program using std::chrono ends up in
+ * libfasttime rather than the C++ runtime, and that the values it
+ * gets are sane. Also exercises the clocks in fasttime.hpp.
+ */
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <time.h>
+
+#include "fasttime.hpp"
+
+#define	NANOSEC			1000000000LL
+#define	TIMESPEC_TO_NS(ts)	(((int64_t)ts.tv_sec * NANOSEC) + ts.tv_nsec)
+
+/*
+ * Pointers to system functions, loaded by libfasttime.so.
+ */
+extern "C" int (*_sys_clock_gettime)(clockid_t clock_id, struct timespec *tp);
+
+/*
+ * The dynamic linker binds every call to the first definition of a
+ * symbol in the global scope. Look the mangled name up the same way
+ * and verify that definition lives in libfasttime; if so the fast
+ * path is what std::chrono callers get.
+ */
+static void
+test_interposed(const char *sym)
+{
+	Dl_info	info;
+	void	*addr;
+
+	if ((addr = dlsym(RTLD_DEFAULT, sym)) == NULL) {
+		printf("ERROR: %s not found\n", sym);
+		exit(1);
+	}
+
+	if (dladdr(addr, &info) == 0 || info.dli_fname == NULL) {
+		printf("ERROR: no object for %s\n", sym);
+		exit(1);
+	}
+
+	if (strstr(info.dli_fname, "libfasttime") == NULL) {
+		printf("ERROR: %s resolved to %s\n", sym, info.dli_fname);
+		exit(1);
+	}
+}
+
+/*
+ * Verify std::chrono::system_clock agrees with the system's
+ * CLOCK_REALTIME to within max_delta_ns.
+ */
+static void
+test_system_clock(int64_t max_delta_ns)
+{
+	struct timespec	sys_ts;
+	int64_t		sys_ns, ft_ns, delta_ns;
+
+	if (_sys_clock_gettime(CLOCK_REALTIME, &sys_ts) == -1) {
+		perror("failed to call system clock_gettime()");
+		exit(1);
+	}
+
+	ft_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::system_clock::now().time_since_epoch()).count();
+	sys_ns = TIMESPEC_TO_NS(sys_ts);
+	delta_ns = llabs(ft_ns - sys_ns);
+
+	if (delta_ns > max_delta_ns) {
+		printf("ERROR: test_system_clock() failed\n");
+		printf("\tsys_ns: %" PRId64 "\n", sys_ns);
+		printf("\tft_ns:  %" PRId64 "\n", ft_ns);
+		exit(1);
+	}
+}
+
+/*
+ * Verify std::chrono::steady_clock is on the same timeline as the
+ * libfasttime CLOCK_MONOTONIC and never goes backwards.
+ */
+static void
+test_steady_clock(int64_t max_delta_ns)
+{
+	struct timespec	ts;
+	int64_t		a_ns, b_ns, c_ns;
+
+	a_ns = std::chrono::steady_clock::now().time_since_epoch().count();
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		perror("failed to query monotonic clock");
+		exit(1);
+	}
+	b_ns = TIMESPEC_TO_NS(ts);
+
+	c_ns = std::chrono::steady_clock::now().time_since_epoch().count();
+
+	if (c_ns < a_ns || b_ns < a_ns - max_delta_ns ||
+	    b_ns > c_ns + max_delta_ns) {
+		printf("ERROR: test_steady_clock() failed\n");
+		printf("\ta_ns: %" PRId64 "\n", a_ns);
+		printf("\tb_ns: %" PRId64 "\n", b_ns);
+		printf("\tc_ns: %" PRId64 "\n", c_ns);
+		exit(1);
+	}
+}
+
+/*
+ * Round trip a time_point through the fasttime.hpp clocks and verify
+ * it lands within max_delta_ns of where it started.
+ */
+static void
+test_clock_cast(int64_t max_delta_ns)
+{
+	typedef fasttime::basic_tsc_clock<2000000000ULL> tsc2g;
+	typedef fasttime::basic_tsc_clock<2100000000ULL> tsc21g;
+	typedef fasttime::basic_tsc_clock<3000000000ULL> tsc3g;
+
+	fasttime::realtime_clock::time_point a, b;
+	int64_t delta_ns;
+
+	a = fasttime::realtime_clock::now();
+	b = fasttime::clock_cast<fasttime::realtime_clock>(
+	    fasttime::clock_cast<fasttime::tsc_clock>(
+	    fasttime::clock_cast<fasttime::steady_clock>(a)));
+	delta_ns = llabs((b - a).count());
+
+	if (delta_ns > max_delta_ns) {
+		printf("ERROR: test_clock_cast() failed\n");
+		printf("\tdelta_ns: %" PRId64 "\n", delta_ns);
+		exit(1);
+	}
+
+	static_assert(tsc2g::to_nanoseconds(
+	    tsc2g::duration(2000000000)).count() == 1000000000,
+	    "compile-time TSC scale is wrong");
+	static_assert(tsc2g::from_nanoseconds(
+	    std::chrono::microseconds(1)).count() == 2000,
+	    "compile-time TSC scale is wrong");
+	static_assert(tsc3g::to_nanoseconds(
+	    tsc3g::duration(3600 * 3000000000LL)) == std::chrono::hours(1),
+	    "compile-time TSC conversion is inexact");
+	static_assert(tsc21g::to_nanoseconds(
+	    tsc21g::duration(60 * 2100000000LL)) == std::chrono::minutes(1),
+	    "compile-time TSC conversion is inexact");
+	static_assert(tsc21g::to_nanoseconds(tsc21g::from_nanoseconds(
+	    std::chrono::nanoseconds(1000000))).count() == 1000000,
+	    "compile-time TSC conversion is inexact");
+}
+
+int
+main()
+{
+	int i;
+
+	test_interposed("_ZNSt6chrono3_V212system_clock3nowEv");
+	test_interposed("_ZNSt6chrono3_V212steady_clock3nowEv");
+
+	for (i = 0; i < 1000; i++) {
+		test_system_clock(100000);
+		test_steady_clock(100000);
+		test_clock_cast(100000);
+	}
+
+	return (0);
+}
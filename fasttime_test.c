@@ -13,9 +13,11 @@
  * and the local libfasttime clock (base_* variables).
  */
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -28,7 +30,10 @@
 #include <sched.h>
 #endif
 
+#include "fasttime.h"
+
 #ifdef __linux
+#define	MILLISEC		1000
 #define	MICROSEC		1000000
 #define	NANOSEC			1000000000
 typedef	int			processorid_t;
@@ -236,6 +241,52 @@ print_hist(tvh_t *tvhist)
 	}
 }
 
+/*
+ * Verify that the local monotonic clock is on the kernel's
+ * CLOCK_MONOTONIC timeline: a local reading taken between two system
+ * readings must land between them, give or take max_delta_ns.
+ *
+ * consec_over
+ *
+ *	The number of consecutive invocations in which the local
+ *	reading was further than max_delta_ns outside.
+ *
+ * Return -1 if a test or runtime failure occurs.
+ */
+int
+test_monotonic_delta(int64_t max_delta_ns, int *consec_over)
+{
+	struct timespec	a_ts, ft_ts, b_ts;
+	uint64_t	a_ns, ft_ns, b_ns;
+
+	if (_sys_clock_gettime(CLOCK_MONOTONIC, &a_ts) == -1 ||
+	    clock_gettime(CLOCK_MONOTONIC, &ft_ts) == -1 ||
+	    _sys_clock_gettime(CLOCK_MONOTONIC, &b_ts) == -1) {
+		perror("failed to query monotonic clock");
+		return (-1);
+	}
+
+	a_ns = TIMESPEC_TO_NS(a_ts);
+	ft_ns = TIMESPEC_TO_NS(ft_ts);
+	b_ns = TIMESPEC_TO_NS(b_ts);
+
+	if (ft_ns + max_delta_ns < a_ns || ft_ns > b_ns + max_delta_ns) {
+		*consec_over += 1;
+		if (*consec_over == 3) {
+			printf("\tsys_ns: %" PRIu64 "\n", a_ns);
+			printf("\tlib_ns: %" PRIu64 "\n", ft_ns);
+			printf("\tsys_ns: %" PRIu64 "\n", b_ns);
+			return (-1);
+		}
+
+		return (0);
+	}
+
+	*consec_over = 0;
+
+	return (0);
+}
+
 void
 test_posix_monotonic(const struct timespec *sleep)
 {
@@ -403,6 +454,684 @@ test_posix_xcore(processorid_t cpus[], size_t __attribute__((unused)) num_cpus)
 
 #endif
 
+#define	WHEEL_TIMERS		1000
+#define	WHEEL_MAX_US		5000
+
+#define	WHEEL_LONG_TIMERS	9
+#define	WHEEL_PERIODIC		50
+
+/*
+ * A timer for test_timer_wheel(), fires once no earlier than
+ * wt_expire_tsc unless canceled. On firing it cancels wt_cancel, if
+ * set, spins for wt_spin_tsc, and re-arms itself wt_rearm_tsc out
+ * while wt_rearm is non-zero.
+ */
+typedef struct wheel_test_timer {
+	ft_timer_t		wt_timer;
+	ft_timer_wheel_t	*wt_wheel;
+	uint64_t		wt_expire_tsc;
+	int			wt_fired;
+	int			wt_canceled;
+	struct wheel_test_timer	*wt_cancel;
+	int			wt_rearm;
+	uint64_t		wt_rearm_tsc;
+	uint64_t		wt_spin_tsc;
+} wt_t;
+
+static uint64_t
+rdtsc()
+{
+	unsigned int a, d;
+
+	__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
+
+	return (((uint64_t)a) | ((uint64_t)d) << 32);
+}
+
+static void
+wheel_test_cb(ft_timer_t *timer, void *arg)
+{
+	wt_t *wt = arg;
+	uint64_t now = rdtsc();
+
+	if (now < wt->wt_expire_tsc) {
+		printf("ERROR: timer fired early\n");
+		printf("\texpire: %" PRIu64 "\n", wt->wt_expire_tsc);
+		printf("\tnow:    %" PRIu64 "\n", now);
+		exit(1);
+	}
+
+	wt->wt_fired++;
+
+	if (wt->wt_cancel != NULL) {
+		ft_timer_cancel(wt->wt_wheel, &wt->wt_cancel->wt_timer);
+		wt->wt_cancel->wt_canceled = 1;
+	}
+
+	while (rdtsc() - now < wt->wt_spin_tsc)
+		;
+
+	if (wt->wt_rearm > 0) {
+		wt->wt_rearm--;
+		wt->wt_expire_tsc = rdtsc() + wt->wt_rearm_tsc;
+		ft_timer_add_tsc(wt->wt_wheel, timer, wt->wt_expire_tsc);
+	}
+}
+
+static void
+wheel_test_add(ft_timer_wheel_t *tw, wt_t *wt, uint64_t expire_tsc)
+{
+	(void) memset(wt, 0, sizeof (*wt));
+	wt->wt_wheel = tw;
+	wt->wt_expire_tsc = expire_tsc;
+	ft_timer_init(&wt->wt_timer, wheel_test_cb, wt);
+	ft_timer_add_tsc(tw, &wt->wt_timer, expire_tsc);
+}
+
+/*
+ * Schedule WHEEL_TIMERS timers up to WHEEL_MAX_US out on a wheel with
+ * the given resolution, cancel some of them, and poll until the rest
+ * have fired. Every timer must fire exactly once and not early,
+ * canceled ones never.
+ */
+void
+test_timer_wheel(uint64_t resolution_ns)
+{
+	static wt_t		timers[WHEEL_TIMERS];
+	ft_timer_wheel_t	*tw;
+	uint64_t		cycles_per_us = ft_tsc_hz() / MICROSEC;
+	uint64_t		deadline;
+	unsigned int		i, fired = 0, expected = 0;
+
+	if ((tw = malloc(sizeof (*tw))) == NULL) {
+		perror("failed to malloc()");
+		exit(1);
+	}
+
+	ft_timer_wheel_init(tw, resolution_ns);
+
+	for (i = 0; i < WHEEL_TIMERS; i++) {
+		wheel_test_add(tw, &timers[i],
+		    rdtsc() + (rand() % WHEEL_MAX_US) * cycles_per_us);
+	}
+
+	for (i = 0; i < WHEEL_TIMERS; i++) {
+		if (i % 7 == 0) {
+			ft_timer_cancel(tw, &timers[i].wt_timer);
+			timers[i].wt_canceled = 1;
+		} else {
+			expected++;
+		}
+	}
+
+	deadline = rdtsc() + (WHEEL_MAX_US + 1000000) * cycles_per_us;
+	while (fired < expected) {
+		fired += ft_timer_wheel_poll(tw);
+
+		if (rdtsc() > deadline) {
+			printf("ERROR: test_timer_wheel() timed out\n");
+			printf("\tfired: %u of %u\n", fired, expected);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < WHEEL_TIMERS; i++) {
+		if (timers[i].wt_fired != (timers[i].wt_canceled ? 0 : 1) ||
+		    ft_timer_pending(&timers[i].wt_timer)) {
+			printf("ERROR: test_timer_wheel() failed\n");
+			printf("\ttimer %u fired %d times, canceled %d\n", i,
+			    timers[i].wt_fired, timers[i].wt_canceled);
+			exit(1);
+		}
+	}
+
+	free(tw);
+}
+
+/*
+ * A lone periodic timer on a 1us wheel whose callback runs for longer
+ * than its period before re-arming, so each re-arm finds the wheel
+ * empty and past the tick poll is working on. It must still never
+ * fire early.
+ */
+void
+test_timer_wheel_periodic()
+{
+	wt_t			timer;
+	ft_timer_wheel_t	*tw;
+	uint64_t		us = ft_tsc_hz() / MICROSEC;
+	uint64_t		deadline;
+
+	if ((tw = malloc(sizeof (*tw))) == NULL) {
+		perror("failed to malloc()");
+		exit(1);
+	}
+
+	ft_timer_wheel_init(tw, 1000);
+	wheel_test_add(tw, &timer, rdtsc() + 100 * us);
+	timer.wt_rearm = WHEEL_PERIODIC - 1;
+	timer.wt_rearm_tsc = 100 * us;
+	timer.wt_spin_tsc = 500 * us;
+
+	deadline = rdtsc() + WHEEL_PERIODIC * 1000 * us + 1000000 * us;
+	while (ft_timer_pending(&timer.wt_timer)) {
+		(void) ft_timer_wheel_poll(tw);
+
+		if (rdtsc() > deadline) {
+			printf("ERROR: test_timer_wheel_periodic() "
+			    "timed out\n");
+			exit(1);
+		}
+	}
+
+	if (timer.wt_fired != WHEEL_PERIODIC) {
+		printf("ERROR: test_timer_wheel_periodic() failed\n");
+		printf("\tfired %d times\n", timer.wt_fired);
+		exit(1);
+	}
+
+	free(tw);
+}
+
+/*
+ * Exercise the upper levels of a 1ns wheel: timers a good part of its
+ * range out (level 3), one past the range (placed in the top level's
+ * last slot until it cascades) and one far beyond it that must still
+ * be pending at the end. Alongside, a timer that re-arms itself from
+ * its callback and two in the same tick that each cancel the other,
+ * so exactly one of them runs.
+ */
+void
+test_timer_wheel_long()
+{
+	static wt_t		timers[WHEEL_LONG_TIMERS];
+	ft_timer_wheel_t	*tw;
+	uint64_t		ms = ft_tsc_hz() / MILLISEC;
+	uint64_t		now, range, deadline;
+	unsigned int		i;
+
+	if ((tw = malloc(sizeof (*tw))) == NULL) {
+		perror("failed to malloc()");
+		exit(1);
+	}
+
+	ft_timer_wheel_init(tw, 1);
+	range = 1ULL << (FT_WHEEL_BITS * FT_WHEEL_LEVELS + tw->tw_shift);
+	now = rdtsc();
+
+	for (i = 0; i < 4; i++)
+		wheel_test_add(tw, &timers[i], now + (range >> (i + 1)));
+	wheel_test_add(tw, &timers[4], now + range + range / 4);
+	wheel_test_add(tw, &timers[5], now + (range << 8));
+
+	wheel_test_add(tw, &timers[6], now + ms);
+	timers[6].wt_rearm = 3;
+	timers[6].wt_rearm_tsc = ms;
+
+	wheel_test_add(tw, &timers[7], now + 2 * ms);
+	wheel_test_add(tw, &timers[8], now + 2 * ms);
+	timers[7].wt_cancel = &timers[8];
+	timers[8].wt_cancel = &timers[7];
+
+	deadline = now + 2 * range + 1000 * ms;
+	while (timers[4].wt_fired == 0) {
+		(void) ft_timer_wheel_poll(tw);
+
+		if (rdtsc() > deadline) {
+			printf("ERROR: test_timer_wheel_long() timed out\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < WHEEL_LONG_TIMERS; i++) {
+		if (i != 5 && ft_timer_pending(&timers[i].wt_timer))
+			break;
+		if (i < 5 && timers[i].wt_fired != 1)
+			break;
+	}
+	if (i < WHEEL_LONG_TIMERS || timers[5].wt_fired != 0 ||
+	    !ft_timer_pending(&timers[5].wt_timer) ||
+	    timers[6].wt_fired != 4 ||
+	    timers[7].wt_fired + timers[8].wt_fired != 1) {
+		printf("ERROR: test_timer_wheel_long() failed\n");
+		for (i = 0; i < WHEEL_LONG_TIMERS; i++) {
+			printf("\ttimer %u fired %d times, pending %d\n", i,
+			    timers[i].wt_fired,
+			    ft_timer_pending(&timers[i].wt_timer));
+		}
+		exit(1);
+	}
+
+	ft_timer_cancel(tw, &timers[5].wt_timer);
+	if (ft_timer_pending(&timers[5].wt_timer) || tw->tw_count != 0) {
+		printf("ERROR: test_timer_wheel_long() cancel failed\n");
+		exit(1);
+	}
+
+	free(tw);
+}
+
+#define	UNIQUE_THREADS		4
+#define	UNIQUE_PER_THREAD	10000
+#define	BENCH_MAX_THREADS	64
+#define	BENCH_MSEC		200
+
+/*
+ * A thread taking values from ft_unique_ns(), or ft_unique_ns_shard()
+ * if ut_shard isn't -1.
+ */
+typedef struct unique_thr {
+	pthread_t	ut_tid;
+	int		ut_shard;
+	uint64_t	*ut_vals;
+} unique_thr_t;
+
+static void *
+unique_thr_run(void *arg)
+{
+	unique_thr_t *ut = arg;
+	int i;
+
+	for (i = 0; i < UNIQUE_PER_THREAD; i++) {
+		ut->ut_vals[i] = (ut->ut_shard == -1) ? ft_unique_ns() :
+		    ft_unique_ns_shard(ut->ut_shard);
+	}
+
+	return (NULL);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Take unique timestamps on several threads at once. Every thread's
+ * values must be strictly increasing (and carry its shard id when
+ * sharded), and no value may have been handed out twice. A shard out
+ * of range must get 0.
+ */
+void
+test_unique_ns(int sharded)
+{
+	static uint64_t	vals[UNIQUE_THREADS * UNIQUE_PER_THREAD];
+	unique_thr_t	thr[UNIQUE_THREADS];
+	uint64_t	*v;
+	int		t, i;
+
+	if (sharded && ft_unique_ns_shard(FT_UNIQUE_SHARD_MAX + 1) != 0) {
+		printf("ERROR: test_unique_ns() accepted shard %u\n",
+		    FT_UNIQUE_SHARD_MAX + 1);
+		exit(1);
+	}
+
+	for (t = 0; t < UNIQUE_THREADS; t++) {
+		thr[t].ut_shard = sharded ? t : -1;
+		thr[t].ut_vals = &vals[t * UNIQUE_PER_THREAD];
+		if (pthread_create(&thr[t].ut_tid, NULL, unique_thr_run,
+		    &thr[t]) != 0) {
+			perror("failed to create thread");
+			exit(1);
+		}
+	}
+
+	for (t = 0; t < UNIQUE_THREADS; t++) {
+		(void) pthread_join(thr[t].ut_tid, NULL);
+
+		v = thr[t].ut_vals;
+		for (i = 0; i < UNIQUE_PER_THREAD; i++) {
+			if ((i > 0 && v[i] <= v[i - 1]) || (sharded &&
+			    (v[i] & FT_UNIQUE_SHARD_MAX) != (uint64_t)t)) {
+				printf("ERROR: test_unique_ns() failed\n");
+				printf("\tthread %d value %d: %" PRIu64 "\n",
+				    t, i, v[i]);
+				exit(1);
+			}
+		}
+	}
+
+	qsort(vals, UNIQUE_THREADS * UNIQUE_PER_THREAD, sizeof (vals[0]),
+	    cmp_u64);
+	for (i = 1; i < UNIQUE_THREADS * UNIQUE_PER_THREAD; i++) {
+		if (vals[i] == vals[i - 1]) {
+			printf("ERROR: test_unique_ns() handed out %" PRIu64
+			    " twice\n", vals[i]);
+			exit(1);
+		}
+	}
+}
+
+/*
+ * Throughput benchmark thread, counts calls until bench_stop is set
+ * and times its own loop.
+ */
+typedef struct bench_thr {
+	pthread_t	bt_tid;
+	int		bt_shard;
+	uint64_t	bt_calls;
+	uint64_t	bt_start;
+	uint64_t	bt_end;
+} __attribute__((aligned(64))) bench_thr_t;
+
+static volatile int		bench_stop;
+static pthread_barrier_t	bench_barrier;
+
+static void *
+bench_thr_run(void *arg)
+{
+	bench_thr_t *bt = arg;
+	struct timespec ts;
+	uint64_t calls = 0;
+
+	(void) pthread_barrier_wait(&bench_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	bt->bt_start = TIMESPEC_TO_NS(ts);
+
+	while (!bench_stop) {
+		if (bt->bt_shard == -1)
+			(void) ft_unique_ns();
+		else
+			(void) ft_unique_ns_shard(bt->bt_shard);
+		calls++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	bt->bt_end = TIMESPEC_TO_NS(ts);
+	bt->bt_calls = calls;
+
+	return (NULL);
+}
+
+/*
+ * Run nthreads threads calling ft_unique_ns() (or the sharded
+ * version) for BENCH_MSEC, returns millions of calls per second over
+ * the span from the first worker starting its loop to the last one
+ * leaving it. With more threads than CPUs workers start and stop at
+ * different times, so the main thread's view of the window won't do.
+ */
+static double
+bench_unique_run(int nthreads, int sharded)
+{
+	static bench_thr_t	thr[BENCH_MAX_THREADS];
+	uint64_t		calls = 0, start = UINT64_MAX, end = 0;
+	int			t;
+
+	bench_stop = 0;
+	(void) pthread_barrier_init(&bench_barrier, NULL, nthreads + 1);
+
+	for (t = 0; t < nthreads; t++) {
+		thr[t].bt_shard = sharded ? t : -1;
+		if (pthread_create(&thr[t].bt_tid, NULL, bench_thr_run,
+		    &thr[t]) != 0) {
+			perror("failed to create thread");
+			exit(1);
+		}
+	}
+
+	(void) pthread_barrier_wait(&bench_barrier);
+	usleep(BENCH_MSEC * 1000);
+	bench_stop = 1;
+
+	for (t = 0; t < nthreads; t++) {
+		(void) pthread_join(thr[t].bt_tid, NULL);
+		calls += thr[t].bt_calls;
+		if (thr[t].bt_start < start)
+			start = thr[t].bt_start;
+		if (thr[t].bt_end > end)
+			end = thr[t].bt_end;
+	}
+
+	(void) pthread_barrier_destroy(&bench_barrier);
+
+	return ((double)calls * 1000.0 / (double)(end - start));
+}
+
+/*
+ * Print ft_unique_ns() and ft_unique_ns_shard() throughput for 1 to
+ * BENCH_MAX_THREADS threads.
+ */
+void
+bench_unique_ns()
+{
+	int n;
+
+	printf("ft_unique_ns() throughput, %ld CPUs online\n",
+	    sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%8s %16s %16s\n", "threads", "global Mcalls/s",
+	    "sharded Mcalls/s");
+
+	for (n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+		printf("%8d %16.1f", n, bench_unique_run(n, 0));
+		printf(" %16.1f\n", bench_unique_run(n, 1));
+	}
+}
+
+#define	LAT_BUCKETS		4096	/* one per cycle, last is overflow */
+#define	LAT_MSEC		1000
+
+static const double lat_pcts[] = { 50, 99, 99.9, 99.99 };
+
+/*
+ * A thread bound to lt_cpu timing CLOCK_MONOTONIC reads into a
+ * histogram of cycles.
+ */
+typedef struct lat_thr {
+	pthread_t	lt_tid;
+	processorid_t	lt_cpu;
+	int		lt_node;	/* from RDTSCP, -1 if unknown */
+	uint64_t	*lt_hist;
+} lat_thr_t;
+
+static void *
+lat_thr_run(void *arg)
+{
+	lat_thr_t	*lt = arg;
+	struct timespec	ts;
+	uint64_t	start, end;
+#ifdef __linux
+	cpu_set_t	cpuset;
+	unsigned int	a, d, aux;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(lt->lt_cpu, &cpuset);
+	if (sched_setaffinity(0, sizeof (cpu_set_t), &cpuset) == -1) {
+		perror("failed to bind thread");
+		exit(1);
+	}
+
+	/* Linux loads TSC_AUX with node << 12 | cpu. */
+	__asm__ volatile("rdtscp" : "=a" (a), "=d" (d), "=c" (aux));
+	lt->lt_node = aux >> 12;
+#elif __sun
+	if (processor_bind(P_LWPID, P_MYID, lt->lt_cpu, NULL) == -1) {
+		perror("failed to bind thread");
+		exit(1);
+	}
+	lt->lt_node = -1;
+#endif
+
+	(void) pthread_barrier_wait(&bench_barrier);
+
+	while (!bench_stop) {
+		start = rdtsc();
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		end = rdtsc();
+
+		lt->lt_hist[(end - start < LAT_BUCKETS - 1) ?
+		    end - start : LAT_BUCKETS - 1]++;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Cycles at the given percentile of a latency histogram, converted to
+ * nanoseconds.
+ */
+static uint64_t
+lat_pct(const uint64_t *hist, double pct)
+{
+	uint64_t total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < LAT_BUCKETS; i++)
+		total += hist[i];
+
+	for (i = 0; i < LAT_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if ((double)sum >= (double)total * pct / 100.0)
+			break;
+	}
+
+	return (ft_tsc_to_ns(i));
+}
+
+/*
+ * Print CLOCK_MONOTONIC read latency for a reader bound to each CPU,
+ * all reading at once for LAT_MSEC so that the shared anchor is
+ * resynced (and republished to every NUMA node's replica) from all
+ * of them along the way. With per-node replicas latency should be
+ * the same whichever socket a CPU is on.
+ */
+void
+bench_read_latency()
+{
+	lat_thr_t	*thr;
+	processorid_t	*cpus;
+	size_t		num_cpus, c;
+	int		i;
+
+	get_cpus(&cpus, &num_cpus);
+
+	if ((thr = calloc(num_cpus, sizeof (*thr))) == NULL) {
+		perror("failed to calloc()");
+		exit(1);
+	}
+
+	bench_stop = 0;
+	(void) pthread_barrier_init(&bench_barrier, NULL, num_cpus + 1);
+
+	for (c = 0; c < num_cpus; c++) {
+		thr[c].lt_cpu = cpus[c];
+		if ((thr[c].lt_hist = calloc(LAT_BUCKETS,
+		    sizeof (uint64_t))) == NULL) {
+			perror("failed to calloc()");
+			exit(1);
+		}
+		if (pthread_create(&thr[c].lt_tid, NULL, lat_thr_run,
+		    &thr[c]) != 0) {
+			perror("failed to create thread");
+			exit(1);
+		}
+	}
+
+	(void) pthread_barrier_wait(&bench_barrier);
+	usleep(LAT_MSEC * 1000);
+	bench_stop = 1;
+
+	printf("CLOCK_MONOTONIC read latency in ns, %zu CPUs, %d ms\n",
+	    num_cpus, LAT_MSEC);
+	printf("%6s %6s %8s %8s %8s %8s\n", "cpu", "node", "p50", "p99",
+	    "p99.9", "p99.99");
+
+	for (c = 0; c < num_cpus; c++) {
+		(void) pthread_join(thr[c].lt_tid, NULL);
+
+		printf("%6d ", thr[c].lt_cpu);
+		if (thr[c].lt_node == -1)
+			printf("%6s", "-");
+		else
+			printf("%6d", thr[c].lt_node);
+		for (i = 0; i < 4; i++) {
+			printf(" %8" PRIu64,
+			    lat_pct(thr[c].lt_hist, lat_pcts[i]));
+		}
+		printf("\n");
+
+		free(thr[c].lt_hist);
+	}
+
+	(void) pthread_barrier_destroy(&bench_barrier);
+	free(thr);
+	free(cpus);
+}
+
+/*
+ * Exercise shadow validation, run with FASTTIME_VALIDATE set (-v).
+ * Keep the realtime clock busy long enough for checks to be done and
+ * verify they were, and that the clock switched to passthrough only
+ * if the threshold is impossibly low (FASTTIME_VALIDATE_MAX_NS=1).
+ * Either way the clocks must still be right afterwards.
+ */
+void
+test_validate()
+{
+	ft_validate_stats_t	vs;
+	struct timespec		ts;
+	uint64_t		end_ns, hz, tsc_ns, prev_tsc_ns;
+	char			*s;
+	int			expect_pass, consec_over = 0, i;
+
+	s = getenv("FASTTIME_VALIDATE_MAX_NS");
+	expect_pass = (s != NULL && strcmp(s, "1") == 0);
+	s = getenv("FASTTIME_VALIDATE_ACTION");
+	if (s != NULL && strcmp(s, "log") == 0)
+		expect_pass = 0;
+
+	/*
+	 * Recalibration must not move ft_tsc_hz() or ft_tsc_to_ns(),
+	 * which tsc_clock (a steady clock) is built on.
+	 */
+	hz = ft_tsc_hz();
+	prev_tsc_ns = ft_tsc_to_ns(rdtsc());
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	end_ns = TIMESPEC_TO_NS(ts) + MS_TO_NS(200);
+	do {
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		tsc_ns = ft_tsc_to_ns(rdtsc());
+		if (tsc_ns < prev_tsc_ns) {
+			printf("ERROR: ft_tsc_to_ns() went backwards\n");
+			printf("\tprev: %" PRIu64 "\n", prev_tsc_ns);
+			printf("\tnow:  %" PRIu64 "\n", tsc_ns);
+			exit(1);
+		}
+		prev_tsc_ns = tsc_ns;
+	} while (TIMESPEC_TO_NS(ts) < end_ns);
+
+	ft_validate_stats(&vs);
+	if (vs.vs_samples == 0 || vs.vs_passthrough != expect_pass ||
+	    ft_tsc_hz() != hz) {
+		printf("ERROR: test_validate() failed\n");
+		printf("\tsamples:        %" PRIu64 "\n", vs.vs_samples);
+		printf("\tbreaches:       %" PRIu64 "\n", vs.vs_breaches);
+		printf("\trecalibrations: %" PRIu64 "\n",
+		    vs.vs_recalibrations);
+		printf("\tmax_err_ns:     %" PRIu64 "\n", vs.vs_max_err_ns);
+		printf("\tpassthrough:    %d\n", vs.vs_passthrough);
+		exit(1);
+	}
+
+	for (i = 0; i < 1000; i++) {
+		if (test_gettimeofday_delta(10, &tvhist, &consec_over) == -1) {
+			printf("ERROR: TOD delta too large\n");
+			exit(1);
+		}
+	}
+
+	consec_over = 0;
+	for (i = 0; i < 1000; i++) {
+		if (test_monotonic_delta(10000, &consec_over) == -1) {
+			printf("ERROR: monotonic delta too large\n");
+			exit(1);
+		}
+	}
+}
+
 /*
  * Run short tests. Each short tests is called back-to-back in rapid
  * succession for the given number of iterations.
@@ -423,6 +1152,14 @@ run_short_tests(unsigned int iters)
 		}
 	}
 
+	consec_over = 0;
+	for (i = 0; i < iters; i++) {
+		if (test_monotonic_delta(10000, &consec_over) == -1) {
+			printf("ERROR: monotonic delta too large\n");
+			exit(1);
+		}
+	}
+
 	for (i = 0; i < iters; i++) {
 		test_posix_monotonic(NULL);
 	}
@@ -438,6 +1175,13 @@ run_short_tests(unsigned int iters)
 	for (i = 0; i < iters; i++) {
 		test_posix_xcore(cpus, cpus_size);
 	}
+
+	test_timer_wheel(1);
+	test_timer_wheel(1000);
+	test_timer_wheel_periodic();
+
+	test_unique_ns(0);
+	test_unique_ns(1);
 }
 
 /*
@@ -450,6 +1194,8 @@ run_long_tests(unsigned int mins)
 	unsigned int	i;
 	unsigned int	secs = mins * 60;
 
+	test_timer_wheel_long();
+
 	for (i = 0; i < secs; i++) {
 		run_short_tests(1000);
 		sleep(1);
@@ -459,16 +1205,25 @@ run_long_tests(unsigned int mins)
 int
 main(int argc, char **argv)
 {
-	int		c, i;
+	int		c, i, bench = 0, latency = 0, validate = 0;
 	unsigned int	seed = 0;
 	unsigned int	mins = 0;
 	struct timespec ts;
 
-	while ((c = getopt(argc, argv, ":l:")) != -1) {
+	while ((c = getopt(argc, argv, ":bl:nv")) != -1) {
 		switch (c) {
+		case 'b':
+			bench = 1;
+			break;
 		case 'l':
 			mins = atoi(optarg);
 			break;
+		case 'n':
+			latency = 1;
+			break;
+		case 'v':
+			validate = 1;
+			break;
 		case '?':
 			fprintf(stderr, "Unknown option: %c\n", c);
 			exit(1);
@@ -485,11 +1240,19 @@ main(int argc, char **argv)
 	seed = (seed == 0) ? (unsigned int)ts.tv_nsec : seed;
 	srand(seed);
 
-	if (mins == 0) {
+	if (bench) {
+		bench_unique_ns();
+	} else if (latency) {
+		bench_read_latency();
+	} else if (validate) {
+		test_validate();
+	} else if (mins == 0) {
 		for (i = 0; i < 5; i++) {
 			run_short_tests(1000);
 			sleep(1);
 		}
+		/* Takes seconds, once is enough. */
+		test_timer_wheel_long();
 	} else {
 		run_long_tests(mins);
 	}
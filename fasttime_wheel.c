@@ -0,0 +1,332 @@
+/*
+ * Copyright 2015 Lucera Financial Infrastructure, LLC
+ *
+ * This software may be modified and distributed under the terms of
+ * the MIT license. See the LICENSE file for details.
+ */
+
+/*
+ * Hierarchical timer wheel driven by the TSC, see fasttime.h.
+ *
+ * Level 0 has one slot per tick for the next FT_WHEEL_SLOTS ticks,
+ * level n one slot per FT_WHEEL_SLOTS^n ticks. Each time level 0
+ * wraps, the current slot of level 1 is cascaded: its timers are
+ * placed again by their remaining time, which puts them in level 0.
+ * Level 2 is cascaded when level 1 wraps, and so on up.
+ *
+ * A bitmap of the non-empty slots of each level lets poll skip
+ * straight to the next tick that needs attention, either a non-empty
+ * level 0 slot or the cascade of a non-empty upper level slot, and
+ * gives its TSC value so an idle poll is just RDTSC and a compare.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fasttime.h"
+
+#define	NANOSEC_ULL	1000000000ULL
+#define	WHEEL_MASK	((uint64_t)FT_WHEEL_SLOTS - 1)
+#define	WHEEL_RANGE	(1ULL << (FT_WHEEL_BITS * FT_WHEEL_LEVELS))
+#define	NS_SHIFT	28
+
+static inline uint64_t
+rdtsc()
+{
+	unsigned int a, d;
+
+	__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
+
+	return (((uint64_t)a) | ((uint64_t)d) << 32);
+}
+
+/*
+ * Nanoseconds to TSC cycles with the wheel's 36.28 fixed point scale,
+ * split so the multiply doesn't overflow 64 bits.
+ */
+static uint64_t
+ns_to_cycles(const ft_timer_wheel_t *tw, uint64_t ns)
+{
+	return ((((ns >> 32) * tw->tw_ns_scale) << (32 - NS_SHIFT)) +
+	    (((ns & 0xffffffffULL) * tw->tw_ns_scale) >> NS_SHIFT));
+}
+
+static void
+slot_insert(ft_timer_wheel_t *tw, unsigned int level, unsigned int idx,
+    ft_timer_t *timer)
+{
+	ft_timer_t **slot = &tw->tw_slots[level][idx];
+
+	timer->tm_next = *slot;
+	if (*slot != NULL)
+		(*slot)->tm_pprev = &timer->tm_next;
+	*slot = timer;
+	timer->tm_pprev = slot;
+	tw->tw_bitmap[level][idx / 64] |= 1ULL << (idx % 64);
+}
+
+/*
+ * Put a timer in the slot for its remaining time. Timers already due
+ * go in the slot for the next tick to be processed, timers beyond the
+ * range of the wheel in the last slot of the top level (they are
+ * placed again when it cascades).
+ */
+static void
+timer_place(ft_timer_wheel_t *tw, ft_timer_t *timer)
+{
+	uint64_t expire, delta;
+	unsigned int level, idx;
+
+	expire = (timer->tm_expire < tw->tw_now) ?
+	    tw->tw_now : timer->tm_expire;
+	delta = expire - tw->tw_now;
+
+	if (delta < FT_WHEEL_SLOTS) {
+		slot_insert(tw, 0, expire & WHEEL_MASK, timer);
+		return;
+	}
+
+	if (delta >= WHEEL_RANGE)
+		expire = tw->tw_now + WHEEL_RANGE - 1;
+
+	for (level = 1; level < FT_WHEEL_LEVELS - 1; level++) {
+		if (delta < 1ULL << (FT_WHEEL_BITS * (level + 1)))
+			break;
+	}
+
+	idx = (expire >> (FT_WHEEL_BITS * level)) & WHEEL_MASK;
+	slot_insert(tw, level, idx, timer);
+}
+
+static void
+timer_unlink(ft_timer_wheel_t *tw, ft_timer_t *timer)
+{
+	ft_timer_t **pprev = timer->tm_pprev;
+	uintptr_t slots = (uintptr_t)tw->tw_slots;
+	unsigned int level, idx;
+
+	*pprev = timer->tm_next;
+	if (timer->tm_next != NULL)
+		timer->tm_next->tm_pprev = pprev;
+	timer->tm_next = NULL;
+	timer->tm_pprev = NULL;
+	tw->tw_count--;
+
+	/* Emptied a slot? idx counts slots across all levels. */
+	if (*pprev == NULL && (uintptr_t)pprev >= slots &&
+	    (uintptr_t)pprev < slots + sizeof (tw->tw_slots)) {
+		idx = pprev - &tw->tw_slots[0][0];
+		level = idx / FT_WHEEL_SLOTS;
+		idx %= FT_WHEEL_SLOTS;
+		tw->tw_bitmap[level][idx / 64] &= ~(1ULL << (idx % 64));
+	}
+}
+
+/*
+ * Cascade the current slot of level down a level, returns the slot
+ * index so the caller knows whether the level above wrapped too.
+ */
+static unsigned int
+cascade(ft_timer_wheel_t *tw, unsigned int level)
+{
+	unsigned int idx;
+	ft_timer_t *timer, *next;
+
+	idx = (tw->tw_now >> (FT_WHEEL_BITS * level)) & WHEEL_MASK;
+	timer = tw->tw_slots[level][idx];
+	tw->tw_slots[level][idx] = NULL;
+	tw->tw_bitmap[level][idx / 64] &= ~(1ULL << (idx % 64));
+
+	for (; timer != NULL; timer = next) {
+		next = timer->tm_next;
+		timer_place(tw, timer);
+	}
+
+	return (idx);
+}
+
+/*
+ * The first non-empty slot of bitmap at or after idx, going round
+ * the level; returns how many slots on it is, or FT_WHEEL_SLOTS if
+ * the level is empty.
+ */
+static unsigned int
+slot_dist(const uint64_t *bitmap, unsigned int idx)
+{
+	unsigned int w = idx / 64, n;
+	uint64_t bits = bitmap[w] & (~0ULL << (idx % 64));
+
+	for (n = 0; n <= FT_WHEEL_SLOTS / 64; n++) {
+		if (bits != 0) {
+			return (((w * 64 + __builtin_ctzll(bits)) - idx) &
+			    WHEEL_MASK);
+		}
+		w = (w + 1) % (FT_WHEEL_SLOTS / 64);
+		bits = bitmap[w];
+		/* Back in the first word, only the bits before idx. */
+		if (n == FT_WHEEL_SLOTS / 64 - 1)
+			bits &= ~(~0ULL << (idx % 64));
+	}
+
+	return (FT_WHEEL_SLOTS);
+}
+
+/*
+ * The first tick from tw_now that needs processing, capped at limit:
+ * a non-empty level 0 slot, or the cascade of a non-empty slot of a
+ * higher level. Level n slot idx cascades at the next tick that is a
+ * multiple of FT_WHEEL_SLOTS^n with idx in its level n digit.
+ */
+static uint64_t
+next_tick(const ft_timer_wheel_t *tw, uint64_t limit)
+{
+	uint64_t now = tw->tw_now, tick, next = limit, first;
+	unsigned int level, shift, dist;
+
+	for (level = 0; level < FT_WHEEL_LEVELS; level++) {
+		shift = FT_WHEEL_BITS * level;
+
+		/* The first level n slot boundary at or after now. */
+		first = (now + (1ULL << shift) - 1) >> shift;
+		dist = slot_dist(tw->tw_bitmap[level], first & WHEEL_MASK);
+		if (dist == FT_WHEEL_SLOTS)
+			continue;
+
+		tick = (first + dist) << shift;
+		if (tick < next)
+			next = tick;
+	}
+
+	return (next);
+}
+
+void
+ft_timer_wheel_init(ft_timer_wheel_t *tw, uint64_t resolution_ns)
+{
+	uint64_t cycles;
+
+	(void) memset(tw, 0, sizeof (*tw));
+
+	tw->tw_ns_scale = (ft_tsc_hz() << NS_SHIFT) / NANOSEC_ULL;
+	cycles = ns_to_cycles(tw, resolution_ns);
+	while (cycles >> (tw->tw_shift + 1) != 0)
+		tw->tw_shift++;
+
+	tw->tw_now = rdtsc() >> tw->tw_shift;
+	tw->tw_next_tsc = UINT64_MAX;
+}
+
+void
+ft_timer_init(ft_timer_t *timer, ft_timer_cb_t cb, void *arg)
+{
+	timer->tm_next = NULL;
+	timer->tm_pprev = NULL;
+	timer->tm_expire = 0;
+	timer->tm_cb = cb;
+	timer->tm_arg = arg;
+}
+
+void
+ft_timer_add_tsc(ft_timer_wheel_t *tw, ft_timer_t *timer, uint64_t expire_tsc)
+{
+	uint64_t round = (1ULL << tw->tw_shift) - 1, next_tsc;
+
+	if (timer->tm_pprev != NULL)
+		timer_unlink(tw, timer);
+
+	/*
+	 * Nothing to process in an empty wheel, bring it up to date
+	 * rather than have poll walk the ticks it sat idle.
+	 */
+	if (tw->tw_count == 0 && (rdtsc() >> tw->tw_shift) > tw->tw_now)
+		tw->tw_now = rdtsc() >> tw->tw_shift;
+
+	/* Round up, timers never fire early. */
+	timer->tm_expire = (expire_tsc > UINT64_MAX - round) ?
+	    (UINT64_MAX >> tw->tw_shift) : (expire_tsc + round) >> tw->tw_shift;
+	timer_place(tw, timer);
+	tw->tw_count++;
+
+	next_tsc = ((timer->tm_expire < tw->tw_now) ?
+	    tw->tw_now : timer->tm_expire) << tw->tw_shift;
+	if (next_tsc < tw->tw_next_tsc)
+		tw->tw_next_tsc = next_tsc;
+}
+
+void
+ft_timer_add(ft_timer_wheel_t *tw, ft_timer_t *timer, uint64_t timeout_ns)
+{
+	ft_timer_add_tsc(tw, timer, rdtsc() + ns_to_cycles(tw, timeout_ns));
+}
+
+void
+ft_timer_cancel(ft_timer_wheel_t *tw, ft_timer_t *timer)
+{
+	if (timer->tm_pprev != NULL)
+		timer_unlink(tw, timer);
+}
+
+int
+ft_timer_pending(const ft_timer_t *timer)
+{
+	return (timer->tm_pprev != NULL);
+}
+
+unsigned int
+ft_timer_wheel_poll(ft_timer_wheel_t *tw)
+{
+	uint64_t tsc, target;
+	unsigned int idx, level, fired = 0;
+	ft_timer_t *expired, *timer;
+
+	if ((tsc = rdtsc()) < tw->tw_next_tsc)
+		return (0);
+
+	target = tsc >> tw->tw_shift;
+
+	while (tw->tw_now <= target && tw->tw_count != 0) {
+		idx = tw->tw_now & WHEEL_MASK;
+
+		for (level = 1; idx == 0 && level < FT_WHEEL_LEVELS; level++)
+			idx = cascade(tw, level);
+		idx = tw->tw_now & WHEEL_MASK;
+
+		/*
+		 * Move the slot to a local list so callbacks adding
+		 * timers don't land on it, and advance before running
+		 * them so anything they add that's already due goes in
+		 * the next tick.
+		 */
+		expired = tw->tw_slots[0][idx];
+		tw->tw_slots[0][idx] = NULL;
+		tw->tw_bitmap[0][idx / 64] &= ~(1ULL << (idx % 64));
+		if (expired != NULL)
+			expired->tm_pprev = &expired;
+		tw->tw_now++;
+
+		while ((timer = expired) != NULL) {
+			timer_unlink(tw, timer);
+			timer->tm_cb(timer, timer->tm_arg);
+			fired++;
+		}
+
+		/*
+		 * A callback re-arming the last pending timer brings an
+		 * empty wheel up to date (see ft_timer_add_tsc()), which
+		 * may be past target; tw_now never goes back, or slots
+		 * would alias.
+		 */
+		if (tw->tw_now <= target)
+			tw->tw_now = next_tick(tw, target + 1);
+	}
+
+	if (tw->tw_count == 0) {
+		if (tw->tw_now < target + 1)
+			tw->tw_now = target + 1;
+		tw->tw_next_tsc = UINT64_MAX;
+	} else {
+		tw->tw_next_tsc = next_tick(tw, UINT64_MAX) << tw->tw_shift;
+	}
+
+	return (fired);
+}